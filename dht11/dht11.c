@@ -2,21 +2,91 @@
  *
  * dht11 - Device driver for reading values from DHT11 temperature and humidity sensor.
  *
- * By default the DHT11 is connected to GPIO pin 22 
- * The Major version default is 80 but can be set via the command line.
- * Command line parameters: 
+ * By default the DHT11 is connected to GPIO pin 22
+ * The major number is allocated dynamically, every sensor gets its own minor.
+ * Command line parameters:
  * 			gpio_pin=X - a valid GPIO pin value.
- * 			driverno=X - value for major driver number
+ * 			gpio_pins=X,Y,... - one sensor per pin, overrides gpio_pin
+ * 			sensor_types=X,Y,... - 11 for DHT11 (default), 22 for DHT22, 21 for
+ * 			              AM2301 or 0 to detect it, in gpio_pins order
  * 			format=X   - format of the output from the sensor
+ * 			sample_ms=X - sample the sensors in the background every X ms and
+ * 			              serve opens from the cached reading (0 = off)
+ * 			history_len=X - number of good samples kept per sensor in the ring
+ * 			              that user space can mmap (0 = no history)
+ * 			retry_policy=X - what an open does when the checksum does not match:
+ * 			              0 retries right away, 1 returns the last good sample
+ * 			              marked STALE and retries in the background
+ * 			max_retries=X - transactions per read before giving up
+ * 			retry_backoff_ms=X - pause between the retries, up to 10000
+ * 			max_stale_ms=X - oldest last good sample retry_policy=1 hands out,
+ * 			              older ones make the open retry right away (0 = any age)
+ * 			hwmon_cache_ms=X - oldest cached sample hwmon reads return
+ * 			backend=X   - how the reply is captured: 0 with an IRQ per edge,
+ * 			              1 by polling the pin with IRQs off for ~5ms, 2
+ * 			              alternates to compare them, see the read only
+ * 			              backend_stats parameter
+ * 			filter_temp_rate=X, filter_humidity_rate=X - reject good frames
+ * 			              whose values changed faster than X 0.1 units per
+ * 			              second as outliers and retry (0 = off)
+ * 			filter_median=X - filtered values are the median of the last X
+ * 			              accepted samples (1 = off)
+ * 			filter_ema_shift=X - and then smoothed with an EMA of weight 1/2^X
+ * 			agg_windows=X,Y,... - lengths of the min/max/mean windows in
+ * 			              seconds, up to 4 (default 60,300,3600)
  *
  * Usage:
  * 		Load driver: insmod ./dht11.ko <optional variables>
  * 					i.e.	insmod ./dht11.ko gpio_pin=2 format=3
- * 		Set up device file to read from (i.e.):
- * 					mknod /dev/dht11 c 80 0
- * 					mknod /dev/myfile c <driverno> 0 	
- * 						- to set the output to your own file and driver number
+ * 							insmod ./dht11.ko gpio_pins=4,17,22 sample_ms=5000
+ * 		The device files are created by udev: /dev/dht11 for a single
+ * 		sensor, /dev/dht11-0, /dev/dht11-1, ... in gpio_pins order otherwise.
+ * 		/proc/dht11 lists the samples kept for mmap() of all sensors without
+ * 		reading them, /proc/dht11.csv is the same as CSV.
  *		To read the values from the sensor: cat /dev/dht11
+ *		Programs can switch an open file to fixed size binary records with
+ *		the DHT11_IOC_SET_FORMAT ioctl, see dht11.h. The records carry the
+ *		raw and the filtered values, format=4 prints both. The IIO and
+ *		hwmon interfaces report the filtered values. Dew point, heat index
+ *		and absolute humidity are worked out once per sample in fixed point
+ *		(dht11_metrics.h), they are in the records and format=5 prints them.
+ *		DHT11_IOC_GET_SAMPLES copies up to DHT11_BATCH_MAX samples kept
+ *		for mmap() in one call, for collectors catching up after a pause
+ *		DHT11_IOC_GET_AGGREGATES returns min, max and mean of the filtered
+ *		values over every agg_windows window in one call
+ *		Thresholds with hysteresis are set per sensor in
+ *		/sys/class/dht11/<device> or with DHT11_IOC_SET_THRESHOLDS, alarm
+ *		changes are reported as POLLPRI, on the alarm file and as uevents
+ *		DHT11_IOC_READ returns a sample no older than the age the caller
+ *		gives, reusing the cached one when it can. Without sample_ms an open
+ *		does not talk to the sensor, the first read() does. Reads that
+ *		need a new sample while one is being taken wait for it and share
+ *		it instead of starting their own transaction
+ *		Every good sample is also multicast on the generic netlink family
+ *		"dht11", see dht11.h
+ *		poll() reports POLLIN once a sample newer than the last one read on
+ *		that file is available, the next read then returns it
+ *		Opens, reads and transactions can be traced with the dht11 trace
+ *		events, see dht11_trace.h
+ *		Counters and histograms of every sensor are in debugfs, in
+ *		/sys/kernel/debug/dht11/<device>/stats and histograms. Writing to
+ *		stats clears both. The edges file there holds the raw edges of the
+ *		last transactions, tools/dht11_replay decodes them again offline.
+ *		On kernels with IIO triggered buffer support every sensor is also
+ *		an IIO device named like its device file, with in_temp_raw and
+ *		in_humidityrelative_raw (scale 100, milli units) and a buffer that
+ *		can be driven by any trigger, i.e. with the hrtimer trigger:
+ *				mkdir /sys/kernel/config/iio/triggers/hrtimer/dht11-trig
+ *				echo dht11-trig > /sys/bus/iio/devices/iio:deviceX/trigger/current_trigger
+ *				iio_readdev -b 16 dht11
+ *		Triggers faster than the sensor can answer repeat the last sample.
+ *		With hwmon support there is a hwmon device per sensor as well,
+ *		temp1_input and humidity1_input come from the cached sample and
+ *		only read the sensor when it is older than hwmon_cache_ms.
+ *
+ * Only one sensor is talked to at a time: transactions take bus_lock, and
+ * the background samplers of the sensors are spread evenly over sample_ms
+ * so their start pulses do not queue up behind each other.
  */
 
 #include <linux/module.h>
@@ -27,20 +97,97 @@
 #include <linux/proc_fs.h>
 #include <linux/spinlock.h>
 #include <linux/interrupt.h>
+#include <linux/irq.h>
 #include <linux/time.h>
 #include <linux/delay.h>
 #include <linux/gpio.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/completion.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/sched.h>
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+
+// The IIO interface needs the kernel built with triggered buffer support
+#define DHT11_IIO IS_ENABLED(CONFIG_IIO_TRIGGERED_BUFFER)
+#if DHT11_IIO
+#include <linux/iio/iio.h>
+#include <linux/iio/buffer.h>
+#include <linux/iio/trigger_consumer.h>
+#include <linux/iio/triggered_buffer.h>
+#endif
+#define DHT11_HWMON IS_ENABLED(CONFIG_HWMON)
+#if DHT11_HWMON
+#include <linux/hwmon.h>
+#endif
+#define DHT11_NETLINK IS_ENABLED(CONFIG_NET)
+#if DHT11_NETLINK
+#include <net/genetlink.h>
+#endif
 
 #include <asm/uaccess.h>		// for put_user
 
 // include RPI hardware specific constants
 #include <mach/hardware.h>
 
+#include "dht11.h"
+#include "dht11_decode.h"
+#include "dht11_metrics.h"
+
+#define CREATE_TRACE_POINTS
+#include "dht11_trace.h"
+
 #define DHT11_DRIVER_NAME "dht11"
-#define DEV_COUNT 1
+#define DHT11_MAX_SENSORS 8
 #define RBUF_LEN 256
 #define SUCCESS 0
-#define BUF_LEN 80
+#define BUF_LEN 128
+
+// Retry policies
+#define DHT11_RETRY_BLOCK 0		// Retry before the open returns
+#define DHT11_RETRY_STALE 1		// Return the last good sample at once, retry in the background
+
+// Acquisition timing
+#define DHT11_WAKE_MS 250		// Line held high before the start pulse
+#define DHT11_START_MS 20		// DHT11 needs min 18mS to signal a startup
+#define DHT22_START_US 1100		// DHT22 needs min 1mS
+#define DHT11_CAPTURE_MS 10		// Give the dht11 time to reply
+#define DHT11_RETRY_MS 2100		// Can only read from sensor every 1 second so give it time to recover
+#define DHT11_MAX_RETRY 2
+#define DHT11_MAX_BACKOFF_MS 10000	// Longest pause between retries
+#define DHT11_MAX_STALE_MS 60000	// Default age limit of a stale sample
+#define DHT11_HWMON_CACHE_MS 30000	// Default age of the sample hwmon reads return
+#define DHT11_MIN_INTERVAL_MS 1000	// Shortest time between two transactions on a DHT11
+#define DHT22_MIN_INTERVAL_MS 2000	// and on a DHT22
+#define DHT11_MAX_HISTORY 65536
+#define DHT11_LOAD_BUCKETS 4
+#define DHT11_TRACE_FRAMES 16	// Transactions kept for the debugfs edges file
+#define DHT11_POLL_US 6000		// Longest polled capture, a reply takes up to ~4.8ms
+#define DHT11_MAX_MEDIAN 9		// Longest median filter window
+#define DHT11_FILTER_SLACK 10	// Change always allowed by the rate limits, one DHT11 step
+#define DHT11_MAX_OUTLIERS 3	// Rejected samples in a row before the filter accepts a jump
+
+// Acquisition backends, the values of the backend parameter
+#define DHT11_BACKEND_IRQ 0		// One IRQ per edge, stamped by irq_handler()
+#define DHT11_BACKEND_POLL 1	// GPLEV0 read in a loop with IRQs off for the whole reply
+#define DHT11_BACKEND_COMPARE 2	// Alternate between the two, see backend_stats
+#define DHT11_BACKENDS 2
+
+// debugfs histograms
+#define DHT11_LOG2_BUCKETS 24	// Bucket k counts values in [2^(k-1), 2^k), the last one everything above
+#define DHT11_WIDTH_BUCKETS 32	// Pulse widths in DHT11_WIDTH_STEP_US steps, the last one everything above
+#define DHT11_WIDTH_STEP_US 4
 
 // set GPIO pin g as input
 #define GPIO_DIR_INPUT(g) *(gpio+((g)/10)) &= ~(7<<(((g)%10)*3))
@@ -55,48 +202,307 @@
 // Clear GPIO interrupt on the pin we use
 #define GPIO_INT_CLEAR(g) *(gpio+16) = (*(gpio+16) | (1<<g));
 // GPREN0 GPIO Pin Rising Eedg Detect Enable/Disable
-#define GPIO_INT_RISING(g,v) *(gpio+19) = v ? (*(gpio+19) | (1<<g)) : (*(gpio+19)^(1<<g))
+#define GPIO_INT_RISING(g,v) *(gpio+19) = v ? (*(gpio+19) | (1<<g)) : (*(gpio+19) & ~(1<<g))
 // GPREN0 GPIO Pin Falling Edge Detect Enable/Disable
-#define GPIO_INT_FALLING(g,v) *(gpio+22) = v ? (*(gpio+22) | (1<<g)) : (*(gpio+22)^(1<<g))
-
+#define GPIO_INT_FALLING(g,v) *(gpio+22) = v ? (*(gpio+22) | (1<<g)) : (*(gpio+22) & ~(1<<g))
 
 
-// module parameters
-static int sense = 0;
-static struct timeval lasttv = {0, 0};
 
-static spinlock_t lock;
+struct dht11_dev;
 
 // Forward declarations
 static int open_dht11(struct inode *, struct file *);
 static int close_dht11(struct inode *,  struct file *);
 static ssize_t read_dht11(struct file *, char *, size_t, loff_t *);
-static void clear_interrupts(void);
+static long ioctl_dht11(struct file *, unsigned int, unsigned long);
+static int mmap_dht11(struct file *, struct vm_area_struct *);
+static unsigned int poll_dht11(struct file *, poll_table *);
+static void clear_interrupts(struct dht11_dev *);
+static int end_capture(struct dht11_dev *);
 
 
 // Global variables are declared as static, so are global within the file.
-static int Device_Open = 0;	// Is device open? Used to prevent multiple access to device
-static char msg[BUF_LEN];	// The msg the device will give when asked 
-static char *msg_Ptr;	
-static spinlock_t lock;
-static unsigned int bitcount = 0;
-static unsigned int bytecount = 0;
-static unsigned int started = 0;		//Indicate if we have started a read or not
-static unsigned char dht[5];			// For result bytes
+static spinlock_t lock;					// GPIO edge detect registers and capture state
 static int format = 0;					// Default result format
 static int gpio_pin = 22; 	//Default GPIO pin
+static int gpio_pins[DHT11_MAX_SENSORS];
+static unsigned int ngpio_pins;
+static int sensor_types[DHT11_MAX_SENSORS];
+static unsigned int nsensor_types;
+static unsigned long last_cpu_ns = 0;	// CPU time spent by the last acquisition, in ns
+static int sample_ms = 0;				// Background sampling period, 0 = read on the first read()
+static int history_len = 256;			// Good samples kept for mmap()
+static int retry_policy = DHT11_RETRY_BLOCK;
+static int max_retries = DHT11_MAX_RETRY;
+static int retry_backoff_ms = DHT11_RETRY_MS;
+static int max_stale_ms = DHT11_MAX_STALE_MS;
+static int hwmon_cache_ms = DHT11_HWMON_CACHE_MS;
+static int backend = DHT11_BACKEND_IRQ;
+static int filter_temp_rate = 0;		// Largest plausible change in 0.1 C/s, 0 = off
+static int filter_humidity_rate = 0;	// in 0.1 %/s
+static int filter_median = 1;			// Median filter window, 1 = off
+static int filter_ema_shift = 0;		// EMA weight 1/2^X, 0 = off
+static int agg_windows[DHT11_MAX_WINDOWS];
+static unsigned int nagg_windows;
 
 module_param(format, int, S_IRUGO);
 module_param(gpio_pin, int, S_IRUGO);
+module_param_array(gpio_pins, int, &ngpio_pins, S_IRUGO);
+MODULE_PARM_DESC(gpio_pins, "GPIO pins of the sensors, one device each (default: gpio_pin)");
+module_param_array(sensor_types, int, &nsensor_types, S_IRUGO);
+MODULE_PARM_DESC(sensor_types, "Type of each sensor: 11, 21 or 22, 0 = detect from the first good frame (default: 11)");
+module_param(last_cpu_ns, ulong, S_IRUGO);
+MODULE_PARM_DESC(last_cpu_ns, "CPU time spent in timer and IRQ context by the last read (ns)");
+module_param(sample_ms, int, S_IRUGO);
+MODULE_PARM_DESC(sample_ms, "Background sampling period in ms, opens return the cached reading (0 = off)");
+module_param(history_len, int, S_IRUGO);
+MODULE_PARM_DESC(history_len, "Number of good samples per sensor kept in the mmap()able ring (0 = off)");
+module_param(retry_policy, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(retry_policy, "On a bad checksum 0 = retry before returning, 1 = return the last good sample marked stale and retry in the background");
+module_param(max_retries, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(max_retries, "Transactions per read before giving up");
+module_param(retry_backoff_ms, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(retry_backoff_ms, "Pause between retries in ms, up to 10000");
+module_param(max_stale_ms, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(max_stale_ms, "Oldest last good sample handed out as stale, in ms (0 = any age)");
+module_param(hwmon_cache_ms, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(hwmon_cache_ms, "Oldest cached sample hwmon reads return before reading the sensor again, in ms");
+module_param(backend, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(backend, "Reply capture: 0 = IRQ per edge, 1 = polled with IRQs off, 2 = alternate and compare in backend_stats");
+module_param(filter_temp_rate, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(filter_temp_rate, "Reject samples whose temperature changed faster than this, in 0.1 C per second (0 = off)");
+module_param(filter_humidity_rate, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(filter_humidity_rate, "Reject samples whose humidity changed faster than this, in 0.1 % per second (0 = off)");
+module_param(filter_median, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(filter_median, "Filtered values are the median of the last X accepted samples, up to 9 (1 = off)");
+module_param(filter_ema_shift, int, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(filter_ema_shift, "Smooth the filtered values with an EMA of weight 1/2^X, up to 8 (0 = off)");
+module_param_array(agg_windows, int, &nagg_windows, S_IRUGO);
+MODULE_PARM_DESC(agg_windows, "Lengths of the min/max/mean windows in seconds, up to 4 (default: 60,300,3600)");
+
+// One sample as taken by dht11_acquire()
+struct dht11_sample {
+	unsigned char data[5];
+	ktime_t stamp;			// When the sample was taken
+	u32 seq;				// Sequence number, only good samples get one
+	u8 status;				// DHT11_STATUS_*
+	u8 retries;
+	u8 type;				// DHT11_TYPE_* the data was decoded as
+	s16 humidity;			// Filtered values in 0.1 units, raw for a bad sample
+	s16 temperature;
+	s16 dew_point;			// Derived from the filtered values, 0.1 C
+	s16 heat_index;			// 0.1 C
+	u16 abs_humidity;		// 0.01 g/m^3
+	int valid;
+};
+
+// Values in the filter state, indexed by DHT11_FILTER_*
+#define DHT11_FILTER_HUMIDITY 0
+#define DHT11_FILTER_TEMPERATURE 1
+#define DHT11_FILTER_VALUES 2
+
+/*
+ * Filter stage between a good frame and the published sample: rate of
+ * change limits against the last accepted sample, a median of the last
+ * accepted samples and an EMA of the median.
+ */
+struct dht11_filter {
+	int primed;									// There is a last accepted sample
+	s16 last[DHT11_FILTER_VALUES];				// Raw values of the last accepted sample
+	ktime_t last_stamp;
+	int rejected;								// Outliers in a row
+	s16 window[DHT11_FILTER_VALUES][DHT11_MAX_MEDIAN];	// Accepted raw values, a ring
+	unsigned int nwindow;						// Values in the ring, at most DHT11_MAX_MEDIAN
+	unsigned int next;							// Slot the next value goes to
+	int ema_x16[DHT11_FILTER_VALUES];			// 1/16 units
+};
+
+// Per open file state, every reader gets its own copy of the message
+struct dht11_reader {
+	struct dht11_dev *dev;
+	char msg[BUF_LEN];		// The msg the device will give when asked
+	char *msg_Ptr;
+	int format;				// DHT11_FORMAT_*
+	int pending;			// Sample not completely read yet
+	int acquire;			// The first read takes a sample, opens without sample_ms
+	u32 last_seq;			// Newest good sample this file has seen
+	u32 alarm_changes;		// Alarm changes this file has fetched, POLLPRI until it is current
+	struct dht11_sample sample;
+};
+
+// Acquisition state machine, stepped by the sensor's timer and irq_handler()
+enum dht11_state {
+	DHT11_IDLE,
+	DHT11_WAKE,			// Line held high before the start pulse
+	DHT11_START,		// Start pulse, line held low
+	DHT11_CAPTURE,		// Sensor replies, edges are stamped by irq_handler()
+	DHT11_DECODE,		// Capture over, decode_tasklet turns the edges into bytes
+};
+
+// One transaction as kept for the debugfs edges file
+struct dht11_trace {
+	u32 id;								// Transaction number on this sensor
+	u8 nedges;
+	u8 good;							// Passed the checksum
+	u8 data[5];
+	u32 edge[DHT11_MAX_EDGES];			// ns since the line was handed to the sensor, level in bit 31
+};
+
+/*
+ * How the reply is captured. begin() and end() run in process context
+ * around a transaction, capture() in the timer callback right after the
+ * line was handed to the sensor.
+ */
+struct dht11_backend {
+	const char *name;
+	void (*begin)(struct dht11_dev *dev);
+	enum hrtimer_restart (*capture)(struct dht11_dev *dev);
+	void (*end)(struct dht11_dev *dev);
+};
+
+// What the transactions of one backend cost, for backend_stats
+struct dht11_backend_stats {
+	unsigned long tries;
+	unsigned long good;
+	u64 busy_ns;				// Timer and tasklet time of all tries, the IRQ handler does not time itself
+	u64 irq_off_max_ns;			// Longest single timer run, poll_capture() for the poll backend
+};
+
+// Thresholds of one value in struct dht11_dev, indexed by DHT11_LIMIT_*
+#define DHT11_LIMIT_LOW 0
+#define DHT11_LIMIT_HIGH 1
+#define DHT11_LIMIT_HYST 2
+#define DHT11_LIMITS 3
+#define DHT11_DEFAULT_HYST 10	// One DHT11 step
+
+// DHT11_ALARM_* bit of a low or high limit of a DHT11_FILTER_* value
+#define DHT11_ALARM_BIT(value, limit) (1 << ((value) * 2 + (limit)))
+
+// Filtered values of the good samples in one time bucket of a window
+struct dht11_agg_bucket {
+	u32 epoch;					// Bucket number since boot, stale buckets are reset on the next sample
+	u32 count;
+	s32 sum[DHT11_FILTER_VALUES];
+	s16 min[DHT11_FILTER_VALUES];
+	s16 max[DHT11_FILTER_VALUES];
+};
+
+// An aggregate window, a ring of DHT11_AGG_BUCKETS time buckets
+struct dht11_window {
+	u32 bucket_ms;
+	struct dht11_agg_bucket buckets[DHT11_AGG_BUCKETS];
+};
+
+// Event counters in the per-CPU statistics
+enum dht11_stat {
+	DHT11_STAT_TRANSACTIONS,
+	DHT11_STAT_GOOD,
+	DHT11_STAT_CHECKSUM,		// Whole frame, checksum did not match
+	DHT11_STAT_RETRIES,
+	DHT11_STAT_TIMEOUTS,		// Capture window closed before the whole frame was in
+	DHT11_STAT_SHORT_FRAMES,	// No response pulse or not 40 data bits after it
+	DHT11_STAT_GLITCHES,		// High pulses under DHT11_GLITCH_US
+	DHT11_STAT_LONG_PULSES,		// Data bit high pulses over DHT11_LONG_US
+	DHT11_STAT_EDGE_OVERFLOW,	// Edges past DHT11_MAX_EDGES
+	DHT11_STAT_OUTLIERS,		// Good frames the rate limits rejected
+	DHT11_STAT_COUNT
+};
+
+static const char * const stat_names[DHT11_STAT_COUNT] = {
+	"transactions", "good", "checksum_errors", "retries", "timeouts",
+	"short_frames", "glitches", "long_pulses", "edge_overflows", "outliers",
+};
+
+/*
+ * Statistics of one sensor on one CPU, only ever changed with this_cpu
+ * operations so the IRQ handler does not take a lock or bounce a cache
+ * line. Readers add up all CPUs.
+ */
+struct dht11_stats {
+	unsigned long count[DHT11_STAT_COUNT];
+	unsigned int transaction_us[DHT11_LOG2_BUCKETS];	// Start of the wake period to decoded frame
+	unsigned int high_us[DHT11_WIDTH_BUCKETS];			// High pulse widths, the bits
+	unsigned int low_us[DHT11_WIDTH_BUCKETS];			// Low pulse widths, ~50us apart from the response
+};
+
+// 定义设备模型, one per sensor
+struct dht11_dev {
+	struct cdev cdev;
+	int id;								// Minor number, index in gpio_pins
+	int pin;							// GPIO pin of the data line
+	char name[16];						// Device and IRQ name
+	int irq;							// Requested at load, 0 until then
+	int type;							// DHT11_TYPE_*, AUTO until the first good frame
+
+	// Acquisition, only touched by the transaction holding bus_lock
+	enum dht11_state state;
+	struct hrtimer timer;
+	struct completion done;				// Signalled when the reply has been decoded
+	struct tasklet_struct decode_tasklet;
+	struct dht11_edge edges[DHT11_MAX_EDGES];
+	unsigned int nedges;
+	unsigned int falls;					// dht11_capture_fall() edges so far
+	unsigned int edge_overflows;		// Edges past DHT11_MAX_EDGES, counted by the tasklet
+	u64 capture_start_ns;				// When the line was handed to the sensor
+	u64 last_start_ns;					// When the last transaction started, 0 = never
+	u64 busy_ns;						// CPU time of the current transaction
+	u64 irq_off_ns;						// Longest timer run of the current transaction
+	int backend;						// DHT11_BACKEND_* of the current transaction
+	struct dht11_frame frame;			// The decoded reply
+	struct dht11_cal cal;
+	struct dht11_filter filter;			// Only touched with acquire_lock held
+
+	// Raw edges of the last transactions for debugfs
+	struct dht11_trace *traces;
+	u32 ntraces;
+	struct mutex trace_lock;
+
+	struct dht11_backend_stats backend_stats[DHT11_BACKENDS];
+
+	// Transactions and good ones by 1 minute load average: <1, <2, <4, 4 and up
+	unsigned long load_tries[DHT11_LOAD_BUCKETS];
+	unsigned long load_good[DHT11_LOAD_BUCKETS];
+
+	struct dht11_stats __percpu *stats;
+	struct dentry *debugfs;
+
+	struct dht11_sample latest;			// Last good sample
+	u32 sample_seq;
+	spinlock_t latest_lock;
+	struct mutex acquire_lock;			// One acquisition per sensor at a time
+	struct delayed_work sample_work;
+	unsigned long next_sample;			// Jiffies of the next background sample
+	struct delayed_work retry_work;		// Retries of an open that was given a stale sample
+	int failed;							// The last acquisition gave up, latest is stale
+	struct dht11_sample shared;			// Result of the last acquisition, acquire_lock
+	int shared_err;
+	u32 shared_gen;						// Acquisitions finished, read without the lock
+	wait_queue_head_t sample_wait;		// Woken for every good sample
+	struct dht11_window windows[DHT11_MAX_WINDOWS];	// Protected by latest_lock
+
+	// Threshold alarms, protected by latest_lock
+	s16 limits[DHT11_FILTER_VALUES][DHT11_LIMITS];
+	u32 alarms;							// DHT11_ALARM_* raised now
+	u32 alarm_changes;
+	ktime_t alarm_stamp;				// Sample that last changed the alarms
+	struct device *device;				// Class device, NULL once it goes away, acquire_lock
+
+	// Sample ring shared with user space, the records follow the header
+	struct dht11_history *history;
+
+	struct iio_dev *iio;				// NULL without IIO support
+	struct device *hwmon;				// NULL without hwmon support
+};
+
+static struct dht11_dev *sensors;
+static int nsensors;
+static DEFINE_MUTEX(bus_lock);			// Only one transaction on any sensor at a time
 
-// 定义设备模型
-// struct dht11_dev {
-// 	struct cdev cdev;
-// 	struct mutex mutex
-// }
 // 声明设备号
 static dev_t dev_number;
 static int dev_major;
+static struct class *dht11_class;
+static struct dentry *debugfs_root;
 
 struct proc_dir_entry *entry;
 
@@ -105,7 +511,10 @@ static struct file_operations fops = {
 	.owner = THIS_MODULE,
 	.read = read_dht11,
 	.open = open_dht11,
-	.release = close_dht11
+	.release = close_dht11,
+	.unlocked_ioctl = ioctl_dht11,
+	.mmap = mmap_dht11,
+	.poll = poll_dht11
 };
 
 // Possible valid GPIO pins
@@ -113,318 +522,2752 @@ int valid_gpio_pins[] = {0, 1, 4, 8, 7, 9, 10, 11, 14, 15, 17, 18, 21, 22, 23, 2
 
 volatile unsigned *gpio;
 
-// IRQ handler - where the timing takes place
-static irqreturn_t irq_handler(int i, void *blah, struct pt_regs *regs)
+// Histogram bucket of a value on a log2 scale
+static int log2_bucket(u64 value)
 {
-	struct timeval tv;
-	long deltv;
-	int data = 0;
-	int signal;
+	return min(fls64(value), DHT11_LOG2_BUCKETS - 1);
+}
 
+// Histogram bucket of a pulse width
+static int width_bucket(int us)
+{
+	return min(us / DHT11_WIDTH_STEP_US, DHT11_WIDTH_BUCKETS - 1);
+}
 
-	// use the GPIO signal level
-	signal = GPIO_READ_PIN(gpio_pin);
+/*
+ * IRQ handler - only stamps the edge and counts the bits for the end of
+ * the capture. Closing the window, decoding and the statistics are left to
+ * decode_tasklet so interrupts are off for as short as possible on each of
+ * the ~84 edges.
+ */
+static irqreturn_t irq_handler(int irq, void *dev_id)
+{
+	struct dht11_dev *dev = dev_id;
+	u64 now = ktime_get_ns();
+	int signal;
 
+	// use the GPIO signal level
+	signal = GPIO_READ_PIN(dev->pin);
 
 	/* reset interrupt */
-	GPIO_INT_CLEAR(gpio_pin);
-
-	if(sense != -1){
-		// get current time
-		do_gettimeofday(&tv);
+	GPIO_INT_CLEAR(dev->pin);
 
-		// get time since last interrupt in microseconds
-		deltv = tv.tv_sec - lasttv.tv_sec;
+	// The reply is in, the release edge and anything after it is not kept
+	if (dev->falls >= DHT11_CAPTURE_FALLS)
+		return IRQ_HANDLED;
 
-		data = (int) (deltv*1000000 + (tv.tv_usec - lasttv.tv_usec));
-		lasttv = tv;		//Save last interrupt time
+	if (dev->nedges == DHT11_MAX_EDGES) {
+		dev->edge_overflows++;
+		return IRQ_HANDLED;
+	}
 
-		// printk(KERN_INFO DHT11_DRIVER_NAME ": irq_handler()\t started=%d\t signal=%d \t data=%d\n", started, signal, data);
+	// The last data bit is in, no need to wait for the window to close.
+	// Glitches add edges, so the edges are not simply counted.
+	if (dev->nedges && dht11_capture_fall(&dev->edges[dev->nedges - 1], now, signal) &&
+		++dev->falls == DHT11_CAPTURE_FALLS)
+		tasklet_schedule(&dev->decode_tasklet);
 
-		if((signal == 1)&(data > 40))
-		{
-			started = 1;
-			return IRQ_HANDLED;
-		}
-		if((signal == 0)&(started == 1))
-		{
-			if(data > 80)
-				return IRQ_HANDLED;
-			if(data < 15)
-				return IRQ_HANDLED;
-			if(data > 60) //55
-				dht[bytecount] = dht[bytecount] | (0x80 >> bitcount);		// Add a 1 to the data byte
-
-			// Uncomment to log bits and durations - may affect performance and not be accurate!
-			printk("B:%d, d:%d, dt:%d\n", bytecount, bitcount, data);
-			bitcount++;
-			if(bitcount == 8)
-			{
-				bitcount = 0;
-				bytecount++;
-			}
-			// if(bytecount == 5)
-				// printk(KERN_INFO DHT11_DRIVER_NAME "Result: %d, %d, %d, %d,%d\n", dht[0], dht[1], dht[2], dht[3], dht[4], dht[5]);
-		}
-	}
+	dev->edges[dev->nedges].ns = now;
+	dev->edges[dev->nedges].level = signal;
+	dev->nedges++;
 	return IRQ_HANDLED;
 }
 
-
-static int setup_interrupts(void)
+// Enable edge detection on the pin, only done while the sensor is replying
+static void enable_edge_detect(struct dht11_dev *dev)
 {
-	int result;
 	unsigned long flags;
 
-	result = request_irq(gpio_to_irq(22), (irq_handler_t) irq_handler, 0, DHT11_DRIVER_NAME, (void*) gpio);
-
-	switch (result) {
-		case -EBUSY:
-			printk(KERN_ERR DHT11_DRIVER_NAME ": IRQ %d is busy\n", gpio_to_irq(22));
-			return -EBUSY;
-		case -EINVAL:
-			printk(KERN_ERR DHT11_DRIVER_NAME ": Bad irq number or handler\n");
-			return -EINVAL;
-		default:
-			printk(KERN_INFO DHT11_DRIVER_NAME ": Interrupt %04x obtained\n", gpio_to_irq(22));
-			break;
-	}
-
 	spin_lock_irqsave(&lock, flags);
 
 	// GPREN0 GPIO Pin Rising Edge Detect Enable
-	GPIO_INT_RISING(gpio_pin, 1);
+	GPIO_INT_RISING(dev->pin, 1);
 	// GPFEN0 GPIO Pin Falling Edge Detect Enable
-	GPIO_INT_FALLING(gpio_pin, 1);
+	GPIO_INT_FALLING(dev->pin, 1);
 
 	// clear interrupt flag
-	GPIO_INT_CLEAR(gpio_pin);
+	GPIO_INT_CLEAR(dev->pin);
 
 	spin_unlock_irqrestore(&lock, flags);
+}
 
-	return 0;
+// Clear the GPIO edge detect interrupts
+static void disable_edge_detect(struct dht11_dev *dev)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lock, flags);
+
+	// GPREN0 GPIO Pin Rising Edge Detect Disable
+	GPIO_INT_RISING(dev->pin, 0);
+
+	// GPFEN0 GPIO Pin Falling Edge Detect Disable
+	GPIO_INT_FALLING(dev->pin, 0);
+
+	spin_unlock_irqrestore(&lock, flags);
 }
 
-// Initialise GPIO memory
-static int init_port(void)
+// Close the capture window, only the first call counts. Returns whether this call closed it.
+static int end_capture(struct dht11_dev *dev)
 {
-	// reserve GPIO memory region.
-	if (request_mem_region(GPIO_BASE, SZ_4K, DHT11_DRIVER_NAME)) {
-		printk(KERN_ERR DHT11_DRIVER_NAME ": unable to obtain GPIO I/O memory address\n");
-		return -EBUSY;
-	}
+	unsigned long flags;
+	int ending;
 
-	// remap the GPIO memory
-	if ((gpio = ioremap_nocache(GPIO_BASE, SZ_4K)) == NULL) {
-		printk(KERN_ERR DHT11_DRIVER_NAME ": failed to map GPIO I/O memory!\n");
-		return -EBUSY;
-	}
+	spin_lock_irqsave(&lock, flags);
+	ending = (dev->state == DHT11_CAPTURE);
+	if (ending)
+		dev->state = DHT11_DECODE;
+	spin_unlock_irqrestore(&lock, flags);
 
-	return 0;
+	if (ending)
+		disable_edge_detect(dev);
+	return ending;
 }
 
+/*
+ * Decoder - runs once per transaction after the last edge, scheduled by the
+ * IRQ handler or by the timer when the window closes. The decoding itself
+ * is in dht11_decode.h so it can be replayed outside the kernel.
+ */
+static void decode_tasklet_func(unsigned long data)
+{
+	struct dht11_dev *dev = (struct dht11_dev *) data;
+	struct dht11_frame *frame = &dev->frame;
+	u64 enter = ktime_get_ns();
+	int i;
+
+	// The IRQ handler only schedules, the window may still be open
+	end_capture(dev);
+	if (dev->state != DHT11_DECODE)
+		return;					// Already decoded, scheduled by both ends of the window
+	this_cpu_add(dev->stats->count[DHT11_STAT_EDGE_OVERFLOW], dev->edge_overflows);
+
+	if (dht11_decode(dev->edges, dev->nedges, &dev->cal, frame) < 0)
+		this_cpu_inc(dev->stats->count[DHT11_STAT_SHORT_FRAMES]);
+
+	// The spread of the low pulses around 50us is the IRQ latency jitter
+	for (i = 0; i < frame->nlow; i++)
+		this_cpu_inc(dev->stats->low_us[width_bucket(frame->low_us[i])]);
+	for (i = 0; i < frame->nhigh; i++)
+		this_cpu_inc(dev->stats->high_us[width_bucket(frame->high_us[i])]);
+	this_cpu_add(dev->stats->count[DHT11_STAT_GLITCHES], frame->glitches);
+	this_cpu_add(dev->stats->count[DHT11_STAT_LONG_PULSES], frame->long_pulses);
+
+	dev->state = DHT11_IDLE;
+	dev->busy_ns += ktime_get_ns() - enter;
+	complete(&dev->done);
+}
 
-static int __init dht11_init(void)
+// Bucket of the current 1 minute load average for the success rate statistics
+static int load_bucket(void)
 {
-	int result;
-	int i; 
+	unsigned long load = avenrun[0] >> FSHIFT;
 
-	// check for valid gpio pin number
-	result = 0;
-	for(i = 0; (i < ARRAY_SIZE(valid_gpio_pins)) && (result != 1); i++) {
-		if(gpio_pin == valid_gpio_pins[i])
-			result++;
-	}
+	if (load < 1)
+		return 0;
+	if (load < 2)
+		return 1;
+	if (load < 4)
+		return 2;
+	return 3;
+}
 
-	if (result != 1) {
-		result = -EINVAL;
-		printk(KERN_ERR DHT11_DRIVER_NAME ": invalid GPIO pin specified!\n");
-		goto exit_rpi;
+// decode_stats parameter: success rate by load and the current calibration of every sensor
+static int decode_stats_get(char *buffer, const struct kernel_param *kp)
+{
+	static const char * const names[DHT11_LOAD_BUCKETS] = { "0-1", "1-2", "2-4", "4+" };
+	struct dht11_dev *dev;
+	int len = 0;
+	int i, s;
+
+	for (s = 0; s < nsensors; s++) {
+		dev = &sensors[s];
+		len += sprintf(buffer + len, "%s (GPIO %d)\n", dev->name, dev->pin);
+		for (i = 0; i < DHT11_LOAD_BUCKETS; i++)
+			len += sprintf(buffer + len, "load %s: %lu/%lu good\n", names[i],
+						   dev->load_good[i], dev->load_tries[i]);
+		len += sprintf(buffer + len, "0: %dus 1: %dus threshold: %dus\n", dev->cal.zero_x16 / 16,
+					   dev->cal.one_x16 / 16, dht11_cal_threshold(&dev->cal));
 	}
 
-	result = alloc_chrdev_region(&dev_number, 0, DEV_COUNT, DHT11_DRIVER_NAME);
+	return len;
+}
 
-	if (result < 0) {
-		printk(KERN_ALERT DHT11_DRIVER_NAME ": Registering dht11 driver failed with %d\n", result);
-		return result;
-	}
+static const struct kernel_param_ops decode_stats_ops = {
+	.get = decode_stats_get,
+};
+module_param_cb(decode_stats, &decode_stats_ops, NULL, S_IRUGO);
+MODULE_PARM_DESC(decode_stats, "Transactions that passed the checksum by load average, and the decoder calibration");
 
-	dev_major = MAJOR(dev_number);
+// The DHT21 and DHT22 send the same 16 bit frame
+static int is_dht22(int type)
+{
+	return type == DHT11_TYPE_DHT21 || type == DHT11_TYPE_DHT22;
+}
 
-	printk(KERN_INFO DHT11_DRIVER_NAME ": driver registered!\n");
+// Start pulse for the sensor's type, a sensor that is not detected yet gets the DHT11 one
+static unsigned int start_pulse_us(struct dht11_dev *dev)
+{
+	return is_dht22(dev->type) ? DHT22_START_US : DHT11_START_MS * USEC_PER_MSEC;
+}
 
-	entry = proc_create(DHT11_DRIVER_NAME, 0, NULL, &fops);
+// Pause between retries, retry_backoff_ms can be changed at any time
+static unsigned int retry_backoff(void)
+{
+	return clamp(retry_backoff_ms, 0, DHT11_MAX_BACKOFF_MS);
+}
 
-	result = init_port();
-	if (result < 0)
-		goto exit_rpi;
+// Shortest time between two transactions, the longer one until the type is known
+static unsigned int min_interval_ms(struct dht11_dev *dev)
+{
+	return dev->type == DHT11_TYPE_DHT11 ? DHT11_MIN_INTERVAL_MS : DHT22_MIN_INTERVAL_MS;
+}
 
-	return 0;
+/*
+ * Guess the type from a frame that passed the checksum. A DHT22 sends
+ * humidity and temperature as 16 bit values in 0.1 units, so both high
+ * bytes are at most 3 (102.3). A DHT11 sends whole percent in the first
+ * byte, and does not measure below 20%.
+ */
+static int detect_type(const unsigned char *data)
+{
+	if (data[0] <= 3 && (data[2] & 0x7f) <= 3)
+		return DHT11_TYPE_DHT22;
 
-exit_rpi:
-	return result;
+	return DHT11_TYPE_DHT11;
 }
 
-static void __exit dht11_exit(void)
+// Add up the statistics of a sensor over all CPUs
+static void stats_sum(struct dht11_dev *dev, struct dht11_stats *sum)
 {
-	// release mapped memory and allocated region
-	if (gpio != NULL) {
-		iounmap(gpio);
-		release_mem_region(GPIO_BASE, SZ_4K);
-		printk(DHT11_DRIVER_NAME ": cleaned up resourses\n");
+	struct dht11_stats *cpu_stats;
+	int cpu, i;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		cpu_stats = per_cpu_ptr(dev->stats, cpu);
+		for (i = 0; i < DHT11_STAT_COUNT; i++)
+			sum->count[i] += cpu_stats->count[i];
+		for (i = 0; i < DHT11_LOG2_BUCKETS; i++) {
+			sum->transaction_us[i] += cpu_stats->transaction_us[i];
+		}
+		for (i = 0; i < DHT11_WIDTH_BUCKETS; i++) {
+			sum->high_us[i] += cpu_stats->high_us[i];
+			sum->low_us[i] += cpu_stats->low_us[i];
+		}
 	}
+}
 
-	remove_proc_entry(DHT11_DRIVER_NAME, NULL);
+// debugfs stats: one "name value" line per counter
+static int stats_show(struct seq_file *m, void *v)
+{
+	struct dht11_dev *dev = m->private;
+	struct dht11_stats *sum;
+	int i;
 
-	// Unregister the driver
-	unregister_chrdev(dev_number, DEV_COUNT);
-	printk(DHT11_DRIVER_NAME ": cleaned up module\n");
-}
+	sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
 
+	stats_sum(dev, sum);
+	for (i = 0; i < DHT11_STAT_COUNT; i++)
+		seq_printf(m, "%s %lu\n", stat_names[i], sum->count[i]);
 
-// Called when a process wants to read the dht11 "cat /dev/dht11"
-static int open_dht11(struct inode *inode, struct file *file)
+	kfree(sum);
+	return 0;
+}
+
+static int stats_open(struct inode *inode, struct file *file)
 {
-	char result[3]; 			// To say if the result is trustworthy or not
-	int retry = 0;
+	return single_open(file, stats_show, inode->i_private);
+}
 
-	if (Device_Open)
-		return -EBUSY;
+// Any write clears the counters and histograms, updates racing with it may survive
+static ssize_t stats_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct dht11_dev *dev = ((struct seq_file *) file->private_data)->private;
+	int cpu;
 
-	// try_module_get(THIS_MODULE); 		// Increase use count (看起来这是个不用了的功能：http://stackoverflow.com/questions/1741415/linux-kernel-modules-when-to-use-try-module-get-module-put)
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(dev->stats, cpu), 0, sizeof(struct dht11_stats));
 
-	Device_Open++;
+	return count;
+}
 
-	// Take data low for min 18mS to start up DHT11
-	printk(KERN_INFO DHT11_DRIVER_NAME " Start setup (open_dht11)\n");
+static const struct file_operations stats_fops = {
+	.owner = THIS_MODULE,
+	.open = stats_open,
+	.read = seq_read,
+	.write = stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
 
-start_read:
-	started = 0;
-	bitcount = 0;
-	bytecount = 0;
-	dht[0] = 0;
-	dht[1] = 0;
-	dht[2] = 0;
-	dht[3] = 0;
-	dht[4] = 0;
+// One histogram on a log2 scale, empty buckets are left out
+static void show_log2(struct seq_file *m, const char *name, const char *unit, const unsigned int *hist)
+{
+	int i;
+
+	seq_printf(m, "%s:\n", name);
+	for (i = 0; i < DHT11_LOG2_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		if (i == DHT11_LOG2_BUCKETS - 1)
+			seq_printf(m, "  >= %llu%s: %u\n", 1ULL << (i - 1), unit, hist[i]);
+		else
+			seq_printf(m, "  < %llu%s: %u\n", 1ULL << i, unit, hist[i]);
+	}
+}
 
-	GPIO_DIR_OUTPUT(gpio_pin); 			// Set pin to output
-	GPIO_SET_PIN(gpio_pin);				// Take pin high
-	mdelay(250);
-	GPIO_CLEAR_PIN(gpio_pin);			// Set low
-	mdelay(20);							// DHT11 needs min 18mS to signal a startup
-	GPIO_SET_PIN(gpio_pin);				// Take pin high
-	udelay(40);							// Stay high for a bit before swapping to read mode
-	GPIO_DIR_INPUT(gpio_pin);			// Change to read
+// One pulse width histogram, empty buckets are left out
+static void show_widths(struct seq_file *m, const char *name, const unsigned int *hist)
+{
+	int i;
+
+	seq_printf(m, "%s:\n", name);
+	for (i = 0; i < DHT11_WIDTH_BUCKETS; i++) {
+		if (!hist[i])
+			continue;
+		if (i == DHT11_WIDTH_BUCKETS - 1)
+			seq_printf(m, "  >= %dus: %u\n", i * DHT11_WIDTH_STEP_US, hist[i]);
+		else
+			seq_printf(m, "  %d-%dus: %u\n", i * DHT11_WIDTH_STEP_US,
+					   (i + 1) * DHT11_WIDTH_STEP_US - 1, hist[i]);
+	}
+}
 
+/*
+ * debugfs histograms. The time from an edge to its IRQ can not be seen
+ * from here, the spread of the ~50us low pulses shows how much the
+ * latency varies.
+ */
+static int histograms_show(struct seq_file *m, void *v)
+{
+	struct dht11_dev *dev = m->private;
+	struct dht11_stats *sum;
 
-	// Start timer to time pulse length
-	do_gettimeofday(&lasttv);
+	sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
 
-	// Set up interrupts
-	setup_interrupts();
+	stats_sum(dev, sum);
+	show_log2(m, "transaction", "us", sum->transaction_us);
+	show_widths(m, "high_pulse", sum->high_us);
+	show_widths(m, "low_pulse", sum->low_us);
 
-	//Give the dht11 time to reply
-	mdelay(10);
+	kfree(sum);
+	return 0;
+}
 
+static int histograms_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, histograms_show, inode->i_private);
+}
 
-	// printk(KERN_INFO DHT11_DRIVER_NAME "Result: %d, %d, %d, %d,%d\n", dht[0], dht[1], dht[2], dht[3], dht[4], dht[5]);
-	// Check if the read results are valid. If not then try again!
-	if ((dht[0] + dht[1] + dht[2] + dht[3] == dht[4]) & (dht[4] > 0))
-		sprintf(result, "OK");
-	else {
-		retry++;
-		sprintf(result, "BAD");
-		if(retry == 2)
-			goto return_result;
-		clear_interrupts();
+static const struct file_operations histograms_fops = {
+	.owner = THIS_MODULE,
+	.open = histograms_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
 
-		mdelay(2100);			// Can only read from sensor every 1 second so give it time to recover
-		goto start_read;
+// Keep the raw edges of a transaction for the debugfs edges file
+static void trace_add(struct dht11_dev *dev, int good)
+{
+	struct dht11_trace *trace;
+	unsigned int i;
+	u64 ns;
+
+	mutex_lock(&dev->trace_lock);
+	trace = &dev->traces[dev->ntraces % DHT11_TRACE_FRAMES];
+	trace->id = dev->ntraces++;
+	trace->nedges = min_t(unsigned int, dev->nedges, DHT11_MAX_EDGES);
+	trace->good = good;
+	memcpy(trace->data, dev->frame.data, sizeof(trace->data));
+	for (i = 0; i < trace->nedges; i++) {
+		ns = min_t(u64, dev->edges[i].ns - dev->capture_start_ns, 0x7fffffff);
+		trace->edge[i] = (u32) ns | (dev->edges[i].level ? 0x80000000 : 0);
 	}
+	mutex_unlock(&dev->trace_lock);
+}
 
-	// Return the result in various different formats
-return_result:
-	switch(format){
-		case 0:
-			sprintf(msg, "Values: %d, %d, %d, %d, %d, %s\n", dht[0], dht[1], dht[2], dht[3], dht[4], result);
-			break;
-		case 1:
-			sprintf(msg, "%0X,%0X,%0X,%0X,%0X,%s\n", dht[0], dht[1], dht[2], dht[3], dht[4], result);
-			break;
-		case 2:
-			sprintf(msg, "%02X%02X%02X%02X%02X%s\n", dht[0], dht[1], dht[2], dht[3], dht[4], result);
-			break;
-		case 3:
-			sprintf(msg, "Temperature: %dC\nHumidity: %d%%\nResult:%s\n", dht[0], dht[2], result);
-			break;
+/*
+ * debugfs edges: the last transactions, oldest first, in the format
+ * tools/dht11_replay reads. A header line per transaction, then one
+ * "<ns since the line was handed to the sensor> <level>" line per edge.
+ */
+static int edges_show(struct seq_file *m, void *v)
+{
+	struct dht11_dev *dev = m->private;
+	struct dht11_trace *trace;
+	u32 first, id;
+	unsigned int i;
+
+	mutex_lock(&dev->trace_lock);
+	first = dev->ntraces > DHT11_TRACE_FRAMES ? dev->ntraces - DHT11_TRACE_FRAMES : 0;
+	for (id = first; id < dev->ntraces; id++) {
+		trace = &dev->traces[id % DHT11_TRACE_FRAMES];
+		seq_printf(m, "# transaction %u %s gpio %d edges %u data %02x %02x %02x %02x %02x %s\n",
+				   trace->id, dev->name, dev->pin, trace->nedges, trace->data[0], trace->data[1],
+				   trace->data[2], trace->data[3], trace->data[4], trace->good ? "good" : "bad");
+		for (i = 0; i < trace->nedges; i++)
+			seq_printf(m, "%u %u\n", trace->edge[i] & 0x7fffffff, trace->edge[i] >> 31);
+		seq_putc(m, '\n');
 	}
-	msg_Ptr = msg;
+	mutex_unlock(&dev->trace_lock);
 
-	return SUCCESS;
+	return 0;
 }
 
-// Called when a process closes the device file.
-static int close_dht11(struct inode *inode, struct file *file)
+static int edges_open(struct inode *inode, struct file *file)
 {
-	// Decrement the usage count, or else once you opened the file, you'll never get get rid of the module.
-	// module_put(THIS_MODULE);
-	Device_Open--;
+	return single_open(file, edges_show, inode->i_private);
+}
+
+static const struct file_operations edges_fops = {
+	.owner = THIS_MODULE,
+	.open = edges_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
 
-	clear_interrupts();
+static void irq_begin(struct dht11_dev *dev)
+{
+	enable_irq(dev->irq);				// Edge detect stays off until the capture window
+}
 
-	printk(KERN_INFO DHT11_DRIVER_NAME ": Device release(close_dht11)\n");
+// Time the pulse lengths with an IRQ per edge until the capture window closes
+static enum hrtimer_restart irq_capture(struct dht11_dev *dev)
+{
+	enable_edge_detect(dev);
+	dev->state = DHT11_CAPTURE;
+	hrtimer_forward_now(&dev->timer, ms_to_ktime(DHT11_CAPTURE_MS));
+	return HRTIMER_RESTART;
+}
 
-	return 0;
+static void irq_end(struct dht11_dev *dev)
+{
+	disable_irq(dev->irq);
 }
 
-// Clear the GPIO edge detect interrupts
-static void clear_interrupts(void)
+/*
+ * Polled capture, the counted loop of DHT::read() with a clock instead of
+ * a loop count: read GPLEV0 with local IRQs off until the whole reply is in
+ * or DHT11_POLL_US have passed, stamping every level change. The stamps
+ * come from ktime_get_ns(), which reads the ARM architected counter on
+ * boards that have one. Costs the whole reply in CPU time with IRQs off,
+ * but no edge can be late.
+ */
+static enum hrtimer_restart poll_capture(struct dht11_dev *dev)
 {
+	u64 deadline = dev->capture_start_ns + DHT11_POLL_US * NSEC_PER_USEC;
 	unsigned long flags;
+	int level = 1;						// The pull-up holds the line until the sensor answers
+	int signal;
+	u64 now;
+
+	dev->state = DHT11_CAPTURE;
+
+	local_irq_save(flags);
+	do {
+		signal = GPIO_READ_PIN(dev->pin);
+		now = ktime_get_ns();
+		if (signal != level) {
+			if (dev->nedges && dht11_capture_fall(&dev->edges[dev->nedges - 1], now, signal))
+				dev->falls++;
+			dev->edges[dev->nedges].ns = now;
+			dev->edges[dev->nedges].level = signal;
+			dev->nedges++;
+			level = signal;
+		}
+	} while (dev->falls < DHT11_CAPTURE_FALLS && dev->nedges < DHT11_MAX_EDGES && now < deadline);
+	local_irq_restore(flags);
+
+	if (dev->falls < DHT11_CAPTURE_FALLS)
+		this_cpu_inc(dev->stats->count[DHT11_STAT_TIMEOUTS]);
+	end_capture(dev);
+	tasklet_schedule(&dev->decode_tasklet);
+	return HRTIMER_NORESTART;
+}
 
-	spin_lock_irqsave(&lock, flags);
+static void poll_nop(struct dht11_dev *dev)
+{
+}
 
-	// GPREN0 GPIO Pin Rising Edge Detect Disable
-	GPIO_INT_RISING(gpio_pin, 0);
+static const struct dht11_backend dht11_backends[DHT11_BACKENDS] = {
+	[DHT11_BACKEND_IRQ] = {
+		.name = "irq",
+		.begin = irq_begin,
+		.capture = irq_capture,
+		.end = irq_end,
+	},
+	[DHT11_BACKEND_POLL] = {
+		.name = "poll",
+		.begin = poll_nop,
+		.capture = poll_capture,
+		.end = poll_nop,
+	},
+};
 
-	// GPFEN0 GPIO Pin Falling Edge Detect Disable
-	GPIO_INT_FALLING(gpio_pin, 0);
+// Backend of the next transaction, compare alternates so both see the same conditions
+static int pick_backend(struct dht11_dev *dev)
+{
+	switch (backend) {
+		case DHT11_BACKEND_POLL:
+			return DHT11_BACKEND_POLL;
+		case DHT11_BACKEND_COMPARE:
+			return dev->backend == DHT11_BACKEND_IRQ ? DHT11_BACKEND_POLL : DHT11_BACKEND_IRQ;
+		default:
+			return DHT11_BACKEND_IRQ;
+	}
+}
 
-	spin_unlock_irqrestore(&lock, flags);
+// backend_stats parameter: success rate, CPU time and longest IRQ off stretch of each backend
+static int backend_stats_get(char *buffer, const struct kernel_param *kp)
+{
+	struct dht11_backend_stats *stats;
+	struct dht11_dev *dev;
+	int len = 0;
+	int b, s;
+
+	for (s = 0; s < nsensors; s++) {
+		dev = &sensors[s];
+		len += sprintf(buffer + len, "%s (GPIO %d)\n", dev->name, dev->pin);
+		for (b = 0; b < DHT11_BACKENDS; b++) {
+			stats = &dev->backend_stats[b];
+			len += sprintf(buffer + len, "%s: %lu/%lu good, %llu us CPU per try, %llu us max IRQ off\n",
+						   dht11_backends[b].name, stats->good, stats->tries,
+						   stats->tries ? div_u64(stats->busy_ns, stats->tries) / NSEC_PER_USEC : 0,
+						   div_u64(stats->irq_off_max_ns, NSEC_PER_USEC));
+		}
+	}
 
-	free_irq(gpio_to_irq(22), (void *) gpio);
+	return len;
 }
 
-// Called when a process, which already opened the dev file, attempts to read from it.
-static ssize_t read_dht11(struct file *filp,	// see include/linux/fs.h
-							char *buffer,		// buffer to fill with data
-							size_t lenght,		// lenght of the buffer
-							loff_t * offset)
+static const struct kernel_param_ops backend_stats_ops = {
+	.get = backend_stats_get,
+};
+module_param_cb(backend_stats, &backend_stats_ops, NULL, S_IRUGO);
+MODULE_PARM_DESC(backend_stats, "Good transactions, CPU time per transaction and longest IRQ off time of each capture backend");
+
+/*
+ * Timer handler - steps the acquisition state machine. The process that
+ * opened the device sleeps on dev->done while the start pulse is timed
+ * here and the reply is captured by the backend. With irq_handler() the
+ * CPU is only used for a few microseconds per state change and per edge.
+ */
+static enum hrtimer_restart dht11_timer_func(struct hrtimer *timer)
 {
-	// Number of bytes actually written to the buffer
-	int bytes_read = 0;
+	struct dht11_dev *dev = container_of(timer, struct dht11_dev, timer);
+	enum hrtimer_restart ret = HRTIMER_RESTART;
+	ktime_t enter = ktime_get();
+
+	switch (dev->state) {
+		case DHT11_WAKE:
+			GPIO_CLEAR_PIN(dev->pin);			// Set low
+			dev->state = DHT11_START;
+			hrtimer_forward_now(timer, ns_to_ktime((u64) start_pulse_us(dev) * NSEC_PER_USEC));
+			break;
+		case DHT11_START:
+			// Take pin high and hand it over to the sensor right away, the
+			// pull-up keeps the line high until the DHT11 answers
+			GPIO_SET_PIN(dev->pin);
+			GPIO_DIR_INPUT(dev->pin);			// Change to read
+
+			dev->capture_start_ns = ktime_get_ns();
+			ret = dht11_backends[dev->backend].capture(dev);
+			break;
+		case DHT11_CAPTURE:
+			// Window closed before the whole frame came in, unless the
+			// last edge raced the timer and its tasklet is already queued
+			if (end_capture(dev) && dev->falls < DHT11_CAPTURE_FALLS) {
+				this_cpu_inc(dev->stats->count[DHT11_STAT_TIMEOUTS]);
+				tasklet_schedule(&dev->decode_tasklet);
+			}
+			ret = HRTIMER_NORESTART;
+			break;
+		default:
+			ret = HRTIMER_NORESTART;
+			break;
+	}
 
-	// If we're at the end of the message, return 0 signifying end of file
-	if (*msg_Ptr == 0)
-		return 0;
+	enter = ktime_sub(ktime_get(), enter);
+	dev->busy_ns += ktime_to_ns(enter);
+	if (ktime_to_ns(enter) > dev->irq_off_ns)
+		dev->irq_off_ns = ktime_to_ns(enter);
+	return ret;
+}
 
-	// Actually put the data into the buffer
-	while(lenght && *msg_Ptr) {
-		// The buffer is in the user data segment, not the kernel segment so "*" assignment won't work. We have to use
-		// put_user which copies data from the kernel datasegment to the user data segment.
-		put_user(*(msg_Ptr++), buffer++);
+// Start one transaction, dev->done is completed once the reply is captured
+static void start_transaction(struct dht11_dev *dev)
+{
+	dev->nedges = 0;
+	dev->falls = 0;
+	dev->edge_overflows = 0;
+	memset(dev->frame.data, 0, sizeof(dev->frame.data));
+	dev->frame.nbits = 0;
+	dev->last_start_ns = ktime_get_ns();
+	dev->irq_off_ns = 0;
+	dev->backend = pick_backend(dev);
+
+	reinit_completion(&dev->done);
+
+	dht11_backends[dev->backend].begin(dev);
+	GPIO_DIR_OUTPUT(dev->pin); 			// Set pin to output
+	GPIO_SET_PIN(dev->pin);				// Take pin high
+	dev->state = DHT11_WAKE;
+	hrtimer_start(&dev->timer, ms_to_ktime(DHT11_WAKE_MS), HRTIMER_MODE_REL);
+}
 
-		lenght--;
-		bytes_read++;
+// Abort a transaction that is still in flight
+static void cancel_transaction(struct dht11_dev *dev)
+{
+	hrtimer_cancel(&dev->timer);
+	if (dev->state == DHT11_CAPTURE)
+		disable_edge_detect(dev);
+	dht11_backends[dev->backend].end(dev);
+	tasklet_kill(&dev->decode_tasklet);
+	dev->state = DHT11_IDLE;
+	GPIO_DIR_INPUT(dev->pin);
+}
+
+/*
+ * Request the sensor's IRQ, once when the module is loaded. It is kept
+ * masked between transactions and the GPIO edge detect only fires during
+ * the capture window, so a transaction costs no IRQ setup.
+ */
+static int setup_interrupts(struct dht11_dev *dev)
+{
+	int irq = gpio_to_irq(dev->pin);
+	int result;
+
+	if (irq < 0) {
+		printk(KERN_ERR DHT11_DRIVER_NAME ": no IRQ for GPIO %d\n", dev->pin);
+		return irq;
 	}
-	printk(KERN_INFO DHT11_DRIVER_NAME ": Call device_read()");
 
-	// Return the number of bytes put into the buffer
-	return bytes_read;
-}
+	irq_set_status_flags(irq, IRQ_NOAUTOEN);
+	result = request_irq(irq, irq_handler, 0, dev->name, dev);
+
+	switch (result) {
+		case 0:
+			break;
+		case -EBUSY:
+			printk(KERN_ERR DHT11_DRIVER_NAME ": IRQ %d is busy\n", irq);
+			break;
+		case -EINVAL:
+			printk(KERN_ERR DHT11_DRIVER_NAME ": Bad irq number or handler\n");
+			break;
+		default:
+			printk(KERN_ERR DHT11_DRIVER_NAME ": Error %d requesting IRQ %d\n", result, irq);
+			break;
+	}
+	if (result < 0) {
+		irq_clear_status_flags(irq, IRQ_NOAUTOEN);
+		return result;
+	}
+
+	dev->irq = irq;
+	return 0;
+}
+
+/*
+ * Decode humidity and temperature in 0.1 units. DHT11 sends integer and
+ * decimal bytes, the DHT22 sends 16 bit values in 0.1 units with the sign
+ * of the temperature in the top bit, see readTemperature() in DHT.cpp.
+ */
+static void decode_values(int type, const unsigned char *data, s16 *humidity, s16 *temperature)
+{
+	if (is_dht22(type)) {
+		*humidity = (data[0] << 8) | data[1];
+		*temperature = ((data[2] & 0x7f) << 8) | data[3];
+		if (data[2] & 0x80)
+			*temperature = -*temperature;
+		return;
+	}
+
+	*humidity = data[0] * 10 + data[1];
+	*temperature = data[2] * 10 + (data[3] & 0x7f);
+	if (data[3] & 0x80)
+		*temperature = -*temperature;
+}
+
+// Median of the last n values in one row of the filter ring
+static s16 filter_median_of(const struct dht11_filter *filter, int value, unsigned int n)
+{
+	s16 v[DHT11_MAX_MEDIAN];
+	unsigned int i, j;
+	s16 x;
+
+	for (i = 0; i < n; i++) {
+		x = filter->window[value][(filter->next + DHT11_MAX_MEDIAN - 1 - i) % DHT11_MAX_MEDIAN];
+		// Insertion sort, the window is tiny
+		for (j = i; j > 0 && v[j - 1] > x; j--)
+			v[j] = v[j - 1];
+		v[j] = x;
+	}
+
+	return v[n / 2];
+}
+
+/*
+ * Run a good sample through the filters and set its filtered values.
+ * Returns -EINVAL for an outlier, a sample that changed faster than the
+ * rate limits allow. After DHT11_MAX_OUTLIERS in a row the jump is taken
+ * as real and the filter starts over from it. Must be called with
+ * acquire_lock held.
+ */
+static int filter_sample(struct dht11_dev *dev, struct dht11_sample *sample)
+{
+	static const int * const rates[DHT11_FILTER_VALUES] = { &filter_humidity_rate, &filter_temp_rate };
+	struct dht11_filter *filter = &dev->filter;
+	s16 raw[DHT11_FILTER_VALUES], out[DHT11_FILTER_VALUES];
+	unsigned int n = clamp(filter_median, 1, DHT11_MAX_MEDIAN);
+	int shift = clamp(filter_ema_shift, 0, 8);
+	s64 dt_ms;
+	int i;
+
+	decode_values(sample->type, sample->data, &raw[DHT11_FILTER_HUMIDITY], &raw[DHT11_FILTER_TEMPERATURE]);
+
+	if (filter->primed) {
+		dt_ms = ktime_to_ms(ktime_sub(sample->stamp, filter->last_stamp));
+		for (i = 0; i < DHT11_FILTER_VALUES; i++) {
+			if (*rates[i] <= 0)
+				continue;
+			if (abs(raw[i] - filter->last[i]) > div_s64(*rates[i] * dt_ms, MSEC_PER_SEC) + DHT11_FILTER_SLACK)
+				break;
+		}
+		if (i < DHT11_FILTER_VALUES && ++filter->rejected < DHT11_MAX_OUTLIERS)
+			return -EINVAL;
+		if (i < DHT11_FILTER_VALUES)
+			memset(filter, 0, sizeof(*filter));		// The jump is real, forget the old values
+	}
+
+	filter->primed = 1;
+	filter->rejected = 0;
+	filter->last_stamp = sample->stamp;
+	for (i = 0; i < DHT11_FILTER_VALUES; i++) {
+		filter->last[i] = raw[i];
+		filter->window[i][filter->next] = raw[i];
+	}
+	filter->next = (filter->next + 1) % DHT11_MAX_MEDIAN;
+	if (filter->nwindow < DHT11_MAX_MEDIAN)
+		filter->nwindow++;
+
+	for (i = 0; i < DHT11_FILTER_VALUES; i++) {
+		out[i] = filter_median_of(filter, i, min(n, filter->nwindow));
+
+		// The EMA starts at the first value and is kept up to date when it is off
+		if (filter->nwindow == 1 || !shift)
+			filter->ema_x16[i] = out[i] * 16;
+		else
+			filter->ema_x16[i] += (out[i] * 16 - filter->ema_x16[i]) / (1 << shift);
+		out[i] = DIV_ROUND_CLOSEST(filter->ema_x16[i], 16);
+	}
+
+	sample->humidity = out[DHT11_FILTER_HUMIDITY];
+	sample->temperature = out[DHT11_FILTER_TEMPERATURE];
+	return 0;
+}
+
+// Work out the derived metrics once per sample, so readers only copy them
+static void sample_metrics(struct dht11_sample *sample)
+{
+	sample->dew_point = dht11_dew_point(sample->temperature, sample->humidity);
+	sample->heat_index = dht11_heat_index(sample->temperature, sample->humidity);
+	sample->abs_humidity = dht11_abs_humidity(sample->temperature, sample->humidity);
+}
+
+// Fill in the little endian binary record for a sample
+static void fill_record(struct dht11_record *rec, const struct dht11_sample *sample)
+{
+	s16 humidity, temperature;
+
+	memset(rec, 0, sizeof(*rec));
+	decode_values(sample->type, sample->data, &humidity, &temperature);
+
+	rec->timestamp_ns = cpu_to_le64(ktime_to_ns(sample->stamp));
+	rec->seq = cpu_to_le32(sample->seq);
+	rec->status = sample->status;
+	rec->retries = sample->retries;
+	rec->sensor_type = sample->type;
+	memcpy(rec->raw, sample->data, sizeof(rec->raw));
+	rec->humidity = cpu_to_le16(humidity);
+	rec->temperature = cpu_to_le16(temperature);
+	rec->humidity_filtered = cpu_to_le16(sample->humidity);
+	rec->temperature_filtered = cpu_to_le16(sample->temperature);
+	rec->dew_point = cpu_to_le16(sample->dew_point);
+	rec->heat_index = cpu_to_le16(sample->heat_index);
+	rec->abs_humidity = cpu_to_le16(sample->abs_humidity);
+}
+
+// Slot i of the sample ring
+static struct dht11_record *history_slot(struct dht11_history *history, u32 i)
+{
+	return (struct dht11_record *) ((char *) history + history->data_offset) + i;
+}
+
+/*
+ * Append a sample to the ring. acquire_lock makes this the only writer,
+ * readers retry when they see seq change under them. The update can not
+ * be preempted, so the readers in the kernel only ever spin for the copy
+ * of one record, not for as long as the writer is scheduled out.
+ */
+static void history_add(struct dht11_dev *dev, const struct dht11_sample *sample)
+{
+	struct dht11_history *history = dev->history;
+	struct dht11_record rec;
+
+	if (!history)
+		return;
+
+	fill_record(&rec, sample);
+
+	preempt_disable();
+	history->seq++;
+	smp_wmb();
+
+	memcpy(history_slot(history, history->head), &rec, sizeof(rec));
+	history->generation++;
+	history->head = (history->head + 1) % history->size;
+
+	smp_wmb();
+	history->seq++;
+	preempt_enable();
+}
+
+// Allocate the sample ring, it is zeroed and page aligned so it can be mapped
+static int history_init(struct dht11_dev *dev)
+{
+	unsigned long history_bytes;
+
+	if (history_len <= 0)
+		return 0;
+	if (history_len > DHT11_MAX_HISTORY)
+		history_len = DHT11_MAX_HISTORY;
+
+	history_bytes = PAGE_ALIGN(DHT11_HISTORY_OFFSET + history_len * sizeof(struct dht11_record));
+	dev->history = vmalloc_user(history_bytes);
+	if (!dev->history)
+		return -ENOMEM;
+
+	dev->history->size = history_len;
+	dev->history->record_size = sizeof(struct dht11_record);
+	dev->history->data_offset = DHT11_HISTORY_OFFSET;
+
+	return 0;
+}
+
+/*
+ * DHT11_IOC_GET_SAMPLES: copy the records since batch.since_seq out of
+ * the history ring with one copy_to_user(). Sequence numbers and ring
+ * slots advance together, the record with seq s is in slot (s - 1) % size.
+ * The ring is snapshotted into a bounce buffer under its seq count like a
+ * user space reader does, so a running transaction is not waited for.
+ */
+static long history_get_samples(struct dht11_dev *dev, struct dht11_batch __user *arg)
+{
+	struct dht11_history *history = dev->history;
+	struct dht11_record *records;
+	struct dht11_batch batch;
+	u32 seq, newest, oldest, first, count, slot, part;
+
+	if (!history)
+		return -ENODATA;
+	if (copy_from_user(&batch, arg, sizeof(batch)))
+		return -EFAULT;
+
+	count = min_t(u32, batch.max_records, min_t(u32, history->size, DHT11_BATCH_MAX));
+	records = count ? kmalloc_array(count, sizeof(*records), GFP_KERNEL) : NULL;
+	if (count && !records)
+		return -ENOMEM;
+
+	do {
+		seq = READ_ONCE(history->seq);
+		smp_rmb();
+
+		newest = history->generation;
+		oldest = newest > history->size ? newest - history->size + 1 : 1;
+		first = max(batch.since_seq, oldest);
+		batch.flags = batch.since_seq && batch.since_seq < oldest ? DHT11_BATCH_OVERRUN : 0;
+		batch.count = first <= newest ? min(count, newest - first + 1) : 0;
+		if (first + batch.count <= newest)
+			batch.flags |= DHT11_BATCH_MORE;
+
+		// Oldest first, in at most two pieces around the end of the ring
+		if (batch.count) {
+			slot = (first - 1) % history->size;
+			part = min(batch.count, history->size - slot);
+			memcpy(records, history_slot(history, slot), part * sizeof(*records));
+			memcpy(records + part, history_slot(history, 0), (batch.count - part) * sizeof(*records));
+		}
+
+		smp_rmb();
+	} while ((seq & 1) || seq != READ_ONCE(history->seq));
+
+	batch.next_seq = min(first, newest + 1) + batch.count;
+
+	if (batch.count && copy_to_user((void __user *) (uintptr_t) batch.records, records,
+									batch.count * sizeof(*records))) {
+		kfree(records);
+		return -EFAULT;
+	}
+	kfree(records);
+
+	if (copy_to_user(arg, &batch, sizeof(batch)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * Copy the record with sequence number *seq out of the ring, or the oldest
+ * one if it has been overwritten, and set *seq to the one copied. Returns
+ * -ENODATA when there is no such record yet.
+ */
+static int history_get(struct dht11_dev *dev, u32 *seq, struct dht11_record *rec)
+{
+	struct dht11_history *history = dev->history;
+	u32 count, newest, oldest, want;
+
+	if (!history)
+		return -ENODATA;
+
+	do {
+		count = READ_ONCE(history->seq);
+		smp_rmb();
+
+		newest = history->generation;
+		oldest = newest > history->size ? newest - history->size + 1 : 1;
+		want = max(*seq, oldest);
+		if (want <= newest)
+			memcpy(rec, history_slot(history, (want - 1) % history->size), sizeof(*rec));
+
+		smp_rmb();
+	} while ((count & 1) || count != READ_ONCE(history->seq));
+
+	if (want > newest)
+		return -ENODATA;
+
+	*seq = want;
+	return 0;
+}
+
+/*
+ * Add a good sample to the aggregate windows, O(1) per window: only the
+ * bucket the sample falls in is touched, it is reset first if it still
+ * holds an older period. Called with latest_lock held.
+ */
+static void aggregate_add(struct dht11_dev *dev, const struct dht11_sample *sample)
+{
+	s16 values[DHT11_FILTER_VALUES] = { sample->humidity, sample->temperature };
+	u64 ms = ktime_to_ms(sample->stamp);
+	struct dht11_agg_bucket *bucket;
+	u32 epoch;
+	int w, i;
+
+	for (w = 0; w < nagg_windows; w++) {
+		epoch = div_u64(ms, dev->windows[w].bucket_ms);
+		bucket = &dev->windows[w].buckets[epoch % DHT11_AGG_BUCKETS];
+
+		if (bucket->epoch != epoch || !bucket->count) {
+			bucket->epoch = epoch;
+			bucket->count = 0;
+			for (i = 0; i < DHT11_FILTER_VALUES; i++) {
+				bucket->sum[i] = 0;
+				bucket->min[i] = values[i];
+				bucket->max[i] = values[i];
+			}
+		}
+
+		bucket->count++;
+		for (i = 0; i < DHT11_FILTER_VALUES; i++) {
+			bucket->sum[i] += values[i];
+			bucket->min[i] = min(bucket->min[i], values[i]);
+			bucket->max[i] = max(bucket->max[i], values[i]);
+		}
+	}
+}
+
+// DHT11_IOC_GET_AGGREGATES: combine the buckets of every window that are still current
+static long aggregates_get(struct dht11_dev *dev, struct dht11_aggregates __user *arg)
+{
+	struct dht11_aggregates aggs;
+	struct dht11_aggregate *agg;
+	struct dht11_agg_bucket *bucket;
+	s16 lo[DHT11_FILTER_VALUES], hi[DHT11_FILTER_VALUES];
+	s64 sum[DHT11_FILTER_VALUES];
+	unsigned long flags;
+	ktime_t now = ktime_get();
+	u32 epoch;
+	int w, b, i;
+
+	memset(&aggs, 0, sizeof(aggs));
+	aggs.timestamp_ns = ktime_to_ns(now);
+	aggs.nwindows = nagg_windows;
+
+	spin_lock_irqsave(&dev->latest_lock, flags);
+	for (w = 0; w < nagg_windows; w++) {
+		agg = &aggs.windows[w];
+		agg->window_s = agg_windows[w];
+		epoch = div_u64(ktime_to_ms(now), dev->windows[w].bucket_ms);
+
+		for (b = 0; b < DHT11_AGG_BUCKETS; b++) {
+			bucket = &dev->windows[w].buckets[b];
+			if (!bucket->count || epoch - bucket->epoch >= DHT11_AGG_BUCKETS)
+				continue;
+
+			for (i = 0; i < DHT11_FILTER_VALUES; i++) {
+				if (!agg->count) {
+					sum[i] = 0;
+					lo[i] = bucket->min[i];
+					hi[i] = bucket->max[i];
+				}
+				sum[i] += bucket->sum[i];
+				lo[i] = min(lo[i], bucket->min[i]);
+				hi[i] = max(hi[i], bucket->max[i]);
+			}
+			agg->count += bucket->count;
+		}
+
+		if (agg->count) {
+			agg->humidity_min = lo[DHT11_FILTER_HUMIDITY];
+			agg->humidity_max = hi[DHT11_FILTER_HUMIDITY];
+			agg->humidity_mean = dht11_div_round(sum[DHT11_FILTER_HUMIDITY], agg->count);
+			agg->temperature_min = lo[DHT11_FILTER_TEMPERATURE];
+			agg->temperature_max = hi[DHT11_FILTER_TEMPERATURE];
+			agg->temperature_mean = dht11_div_round(sum[DHT11_FILTER_TEMPERATURE], agg->count);
+		}
+	}
+	spin_unlock_irqrestore(&dev->latest_lock, flags);
+
+	if (copy_to_user(arg, &aggs, sizeof(aggs)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static const char * const alarm_names[] = {
+	"humidity_low", "humidity_high", "temp_low", "temp_high",
+};
+
+// Names of the raised alarms separated by spaces, "none" without any
+static int format_alarms(char *buf, size_t size, u32 alarms)
+{
+	int len = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(alarm_names); i++) {
+		if (alarms & BIT(i))
+			len += scnprintf(buf + len, size - len, "%s%s", len ? " " : "", alarm_names[i]);
+	}
+	if (!len)
+		len = scnprintf(buf, size, "none");
+
+	return len;
+}
+
+/*
+ * Check the filtered values of a good sample against the thresholds and
+ * return the alarms that changed. An alarm is raised beyond its limit and
+ * cleared hyst back inside it, values in between keep the alarm as it is.
+ * Called with latest_lock held.
+ */
+static u32 alarm_update(struct dht11_dev *dev, const struct dht11_sample *sample)
+{
+	s16 values[DHT11_FILTER_VALUES] = { sample->humidity, sample->temperature };
+	u32 alarms = dev->alarms;
+	u32 changed;
+	const s16 *limits;
+	u32 low, high;
+	int i;
+
+	for (i = 0; i < DHT11_FILTER_VALUES; i++) {
+		limits = dev->limits[i];
+		low = DHT11_ALARM_BIT(i, DHT11_LIMIT_LOW);
+		high = DHT11_ALARM_BIT(i, DHT11_LIMIT_HIGH);
+
+		if (limits[DHT11_LIMIT_LOW] == DHT11_THRESHOLD_OFF ||
+			values[i] >= limits[DHT11_LIMIT_LOW] + limits[DHT11_LIMIT_HYST])
+			alarms &= ~low;
+		else if (values[i] < limits[DHT11_LIMIT_LOW])
+			alarms |= low;
+
+		if (limits[DHT11_LIMIT_HIGH] == DHT11_THRESHOLD_OFF ||
+			values[i] <= limits[DHT11_LIMIT_HIGH] - limits[DHT11_LIMIT_HYST])
+			alarms &= ~high;
+		else if (values[i] > limits[DHT11_LIMIT_HIGH])
+			alarms |= high;
+	}
+
+	changed = alarms ^ dev->alarms;
+	if (changed) {
+		dev->alarms = alarms;
+		dev->alarm_changes++;
+		dev->alarm_stamp = sample->stamp;
+	}
+
+	return changed;
+}
+
+/*
+ * Tell user space the alarms changed. Open files see POLLPRI once the
+ * caller wakes sample_wait, pollers of the alarm file in sysfs are woken
+ * here and a change uevent carries the raised alarms. Called with
+ * acquire_lock held, which keeps the class device from going away.
+ */
+static void alarm_notify(struct dht11_dev *dev, u32 alarms)
+{
+	char env[64] = "DHT11_ALARM=";
+	char *envp[] = { env, NULL };
+	int len = strlen(env);
+
+	if (!dev->device)
+		return;
+
+	format_alarms(env + len, sizeof(env) - len, alarms);
+	sysfs_notify(&dev->device->kobj, NULL, "alarm");
+	kobject_uevent_env(&dev->device->kobj, KOBJ_CHANGE, envp);
+}
+
+static u32 alarm_changes(struct dht11_dev *dev)
+{
+	unsigned long flags;
+	u32 changes;
+
+	spin_lock_irqsave(&dev->latest_lock, flags);
+	changes = dev->alarm_changes;
+	spin_unlock_irqrestore(&dev->latest_lock, flags);
+
+	return changes;
+}
+
+// DHT11_IOC_SET_THRESHOLDS: replace all thresholds, they apply from the next sample on
+static long thresholds_set(struct dht11_dev *dev, const struct dht11_thresholds __user *arg)
+{
+	struct dht11_thresholds t;
+	unsigned long flags;
+
+	if (copy_from_user(&t, arg, sizeof(t)))
+		return -EFAULT;
+	if (t.temperature_hyst < 0 || t.humidity_hyst < 0)
+		return -EINVAL;
+
+	spin_lock_irqsave(&dev->latest_lock, flags);
+	dev->limits[DHT11_FILTER_TEMPERATURE][DHT11_LIMIT_LOW] = t.temperature_low;
+	dev->limits[DHT11_FILTER_TEMPERATURE][DHT11_LIMIT_HIGH] = t.temperature_high;
+	dev->limits[DHT11_FILTER_TEMPERATURE][DHT11_LIMIT_HYST] = t.temperature_hyst;
+	dev->limits[DHT11_FILTER_HUMIDITY][DHT11_LIMIT_LOW] = t.humidity_low;
+	dev->limits[DHT11_FILTER_HUMIDITY][DHT11_LIMIT_HIGH] = t.humidity_high;
+	dev->limits[DHT11_FILTER_HUMIDITY][DHT11_LIMIT_HYST] = t.humidity_hyst;
+	spin_unlock_irqrestore(&dev->latest_lock, flags);
+
+	return 0;
+}
+
+// DHT11_IOC_GET_THRESHOLDS
+static long thresholds_get(struct dht11_dev *dev, struct dht11_thresholds __user *arg)
+{
+	struct dht11_thresholds t;
+	unsigned long flags;
+
+	memset(&t, 0, sizeof(t));
+	spin_lock_irqsave(&dev->latest_lock, flags);
+	t.temperature_low = dev->limits[DHT11_FILTER_TEMPERATURE][DHT11_LIMIT_LOW];
+	t.temperature_high = dev->limits[DHT11_FILTER_TEMPERATURE][DHT11_LIMIT_HIGH];
+	t.temperature_hyst = dev->limits[DHT11_FILTER_TEMPERATURE][DHT11_LIMIT_HYST];
+	t.humidity_low = dev->limits[DHT11_FILTER_HUMIDITY][DHT11_LIMIT_LOW];
+	t.humidity_high = dev->limits[DHT11_FILTER_HUMIDITY][DHT11_LIMIT_HIGH];
+	t.humidity_hyst = dev->limits[DHT11_FILTER_HUMIDITY][DHT11_LIMIT_HYST];
+	spin_unlock_irqrestore(&dev->latest_lock, flags);
+
+	if (copy_to_user(arg, &t, sizeof(t)))
+		return -EFAULT;
+
+	return 0;
+}
+
+// DHT11_IOC_GET_ALARMS: the alarms are then current for this file, poll() stops reporting POLLPRI
+static long alarms_get(struct dht11_reader *reader, struct dht11_alarms __user *arg)
+{
+	struct dht11_dev *dev = reader->dev;
+	struct dht11_alarms a;
+	unsigned long flags;
+
+	memset(&a, 0, sizeof(a));
+	spin_lock_irqsave(&dev->latest_lock, flags);
+	a.alarms = dev->alarms;
+	a.changes = dev->alarm_changes;
+	a.timestamp_ns = ktime_to_ns(dev->alarm_stamp);
+	spin_unlock_irqrestore(&dev->latest_lock, flags);
+
+	if (copy_to_user(arg, &a, sizeof(a)))
+		return -EFAULT;
+
+	reader->alarm_changes = a.changes;
+	return 0;
+}
+
+/*
+ * Thresholds in sysfs, /sys/class/dht11/<device>/temp_low and so on, in
+ * 0.1 units. Limits also take "off", the alarm file lists the raised
+ * alarms and can be polled.
+ */
+struct dht11_threshold_attr {
+	struct device_attribute attr;
+	int value;			// DHT11_FILTER_*
+	int limit;			// DHT11_LIMIT_*
+};
+
+static ssize_t threshold_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+	struct dht11_threshold_attr *ta = container_of(attr, struct dht11_threshold_attr, attr);
+	struct dht11_dev *dev = dev_get_drvdata(device);
+	unsigned long flags;
+	s16 value;
+
+	spin_lock_irqsave(&dev->latest_lock, flags);
+	value = dev->limits[ta->value][ta->limit];
+	spin_unlock_irqrestore(&dev->latest_lock, flags);
+
+	if (value == DHT11_THRESHOLD_OFF)
+		return sprintf(buf, "off\n");
+	return sprintf(buf, "%d\n", value);
+}
+
+static ssize_t threshold_store(struct device *device, struct device_attribute *attr,
+							   const char *buf, size_t count)
+{
+	struct dht11_threshold_attr *ta = container_of(attr, struct dht11_threshold_attr, attr);
+	struct dht11_dev *dev = dev_get_drvdata(device);
+	unsigned long flags;
+	s16 value;
+	int err;
+
+	if (ta->limit != DHT11_LIMIT_HYST && sysfs_streq(buf, "off")) {
+		value = DHT11_THRESHOLD_OFF;
+	} else {
+		err = kstrtos16(buf, 0, &value);
+		if (err)
+			return err;
+		if (ta->limit == DHT11_LIMIT_HYST && value < 0)
+			return -EINVAL;
+	}
+
+	spin_lock_irqsave(&dev->latest_lock, flags);
+	dev->limits[ta->value][ta->limit] = value;
+	spin_unlock_irqrestore(&dev->latest_lock, flags);
+
+	return count;
+}
+
+#define DHT11_THRESHOLD_ATTR(_name, _value, _limit) \
+	static struct dht11_threshold_attr dev_attr_##_name = { \
+		__ATTR(_name, S_IRUGO | S_IWUSR, threshold_show, threshold_store), _value, _limit }
+
+DHT11_THRESHOLD_ATTR(temp_low, DHT11_FILTER_TEMPERATURE, DHT11_LIMIT_LOW);
+DHT11_THRESHOLD_ATTR(temp_high, DHT11_FILTER_TEMPERATURE, DHT11_LIMIT_HIGH);
+DHT11_THRESHOLD_ATTR(temp_hyst, DHT11_FILTER_TEMPERATURE, DHT11_LIMIT_HYST);
+DHT11_THRESHOLD_ATTR(humidity_low, DHT11_FILTER_HUMIDITY, DHT11_LIMIT_LOW);
+DHT11_THRESHOLD_ATTR(humidity_high, DHT11_FILTER_HUMIDITY, DHT11_LIMIT_HIGH);
+DHT11_THRESHOLD_ATTR(humidity_hyst, DHT11_FILTER_HUMIDITY, DHT11_LIMIT_HYST);
+
+static ssize_t alarm_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+	struct dht11_dev *dev = dev_get_drvdata(device);
+	unsigned long flags;
+	u32 alarms;
+	int len;
+
+	spin_lock_irqsave(&dev->latest_lock, flags);
+	alarms = dev->alarms;
+	spin_unlock_irqrestore(&dev->latest_lock, flags);
+
+	len = format_alarms(buf, PAGE_SIZE - 1, alarms);
+	buf[len++] = '\n';
+	return len;
+}
+
+static DEVICE_ATTR(alarm, S_IRUGO, alarm_show, NULL);
+
+static struct attribute *dht11_alarm_attrs[] = {
+	&dev_attr_temp_low.attr.attr,
+	&dev_attr_temp_high.attr.attr,
+	&dev_attr_temp_hyst.attr.attr,
+	&dev_attr_humidity_low.attr.attr,
+	&dev_attr_humidity_high.attr.attr,
+	&dev_attr_humidity_hyst.attr.attr,
+	&dev_attr_alarm.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(dht11_alarm);
+
+#if DHT11_NETLINK
+/*
+ * Generic netlink family for local listeners, see dht11.h. A sample is
+ * only turned into a message when the group has subscribers.
+ */
+static int dht11_genl_get(struct sk_buff *skb, struct genl_info *info);
+
+static const struct nla_policy dht11_genl_policy[DHT11_A_MAX + 1] = {
+	[DHT11_A_SENSOR] = { .type = NLA_U32 },
+};
+
+static const struct genl_ops dht11_genl_ops[] = {
+	{
+		.cmd = DHT11_CMD_GET,
+		.policy = dht11_genl_policy,
+		.doit = dht11_genl_get,
+	},
+};
+
+static const struct genl_multicast_group dht11_genl_groups[] = {
+	{ .name = DHT11_GENL_MCGRP },
+};
+
+static struct genl_family dht11_genl_family = {
+	.id = GENL_ID_GENERATE,
+	.name = DHT11_GENL_NAME,
+	.version = DHT11_GENL_VERSION,
+	.maxattr = DHT11_A_MAX,
+};
+
+// A DHT11_CMD_SAMPLE message with the sensor's minor and the sample as a record
+static struct sk_buff *dht11_genl_msg(const struct dht11_dev *dev, const struct dht11_sample *sample,
+									  u32 portid, u32 seq)
+{
+	struct dht11_record rec;
+	struct sk_buff *skb;
+	void *hdr;
+
+	skb = genlmsg_new(nla_total_size(sizeof(u32)) + nla_total_size(sizeof(rec)), GFP_KERNEL);
+	if (!skb)
+		return NULL;
+
+	hdr = genlmsg_put(skb, portid, seq, &dht11_genl_family, 0, DHT11_CMD_SAMPLE);
+	if (!hdr)
+		goto fail;
+
+	fill_record(&rec, sample);
+	if (nla_put_u32(skb, DHT11_A_SENSOR, dev->id) || nla_put(skb, DHT11_A_RECORD, sizeof(rec), &rec))
+		goto fail;
+
+	genlmsg_end(skb, hdr);
+	return skb;
+
+fail:
+	nlmsg_free(skb);
+	return NULL;
+}
+
+// Multicast a published sample, one skb for all listeners
+static void dht11_genl_publish(struct dht11_dev *dev, const struct dht11_sample *sample)
+{
+	struct sk_buff *skb;
+
+	if (!genl_has_listeners(&dht11_genl_family, &init_net, 0))
+		return;
+
+	skb = dht11_genl_msg(dev, sample, 0, 0);
+	if (skb)
+		genlmsg_multicast(&dht11_genl_family, skb, 0, 0, GFP_KERNEL);
+}
+
+// DHT11_CMD_GET: the latest good sample of one sensor, without a transaction
+static int dht11_genl_get(struct sk_buff *skb, struct genl_info *info)
+{
+	struct dht11_sample sample;
+	struct dht11_dev *dev;
+	struct sk_buff *msg;
+	unsigned long flags;
+	u32 id;
+
+	if (!info->attrs[DHT11_A_SENSOR])
+		return -EINVAL;
+	id = nla_get_u32(info->attrs[DHT11_A_SENSOR]);
+	if (id >= nsensors)
+		return -ENODEV;
+	dev = &sensors[id];
+
+	spin_lock_irqsave(&dev->latest_lock, flags);
+	sample = dev->latest;
+	spin_unlock_irqrestore(&dev->latest_lock, flags);
+	if (!sample.valid)
+		return -ENODATA;
+
+	msg = dht11_genl_msg(dev, &sample, info->snd_portid, info->snd_seq);
+	if (!msg)
+		return -ENOMEM;
+
+	return genlmsg_reply(msg, info);
+}
+
+static int dht11_genl_register(void)
+{
+	return genl_register_family_with_ops_groups(&dht11_genl_family, dht11_genl_ops, dht11_genl_groups);
+}
+
+static void dht11_genl_unregister(void)
+{
+	genl_unregister_family(&dht11_genl_family);
+}
+#else
+static void dht11_genl_publish(struct dht11_dev *dev, const struct dht11_sample *sample)
+{
+}
+
+static int dht11_genl_register(void)
+{
+	return 0;
+}
+
+static void dht11_genl_unregister(void)
+{
+}
+#endif
+
+/*
+ * Copy the last good sample marked stale, if there is one and it is no
+ * older than max_stale_ms. Returns 0 if there is nothing to fall back on.
+ */
+static int get_stale(struct dht11_dev *dev, struct dht11_sample *sample)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->latest_lock, flags);
+	*sample = dev->latest;
+	spin_unlock_irqrestore(&dev->latest_lock, flags);
+
+	if (!sample->valid)
+		return 0;
+	if (max_stale_ms > 0 && ktime_to_ms(ktime_sub(ktime_get(), sample->stamp)) > max_stale_ms)
+		return 0;
+
+	sample->status = DHT11_STATUS_STALE;
+	return 1;
+}
+
+/*
+ * Run one acquisition, retrying on a bad checksum. Sleeps until the reply
+ * has been captured, so it must be called from process context with the
+ * sensor's acquire_lock held. bus_lock is only held for each transaction,
+ * other sensors can use the bus while this one recovers between retries.
+ * retry is the number of tries already used, for retries that continue in
+ * the background. The sample is filled in even when the checksum never
+ * matched, a good sample is also published as the latest one.
+ *
+ * With stale_ok the first bad checksum does not wait for a retry: if
+ * there is a recent enough good sample it is returned marked stale with
+ * -EAGAIN, and the caller hands the remaining tries to retry_work.
+ */
+static int dht11_acquire(struct dht11_dev *dev, struct dht11_sample *sample, int retry, int stale_ok)
+{
+	unsigned char *dht = dev->frame.data;
+	struct dht11_backend_stats *backend_stats;
+	int tries = max(max_retries, 1);
+	unsigned long flags;
+	u32 changed, alarms;
+	u64 duration_us;
+	u64 busy_ns;
+	u64 elapsed_ms;
+	bool good;
+	int bucket;
+	int err;
+
+	dev->busy_ns = 0;
+	memset(sample, 0, sizeof(*sample));
+
+	for (;;) {
+		// Give the sensor time to recover from the last transaction. In u64,
+		// a sensor can be idle for longer than a 32 bit long holds in ms.
+		elapsed_ms = div_u64(ktime_get_ns() - dev->last_start_ns, NSEC_PER_MSEC);
+		if (dev->last_start_ns && elapsed_ms < min_interval_ms(dev) &&
+			msleep_interruptible(min_interval_ms(dev) - (unsigned int) elapsed_ms)) {
+			err = -ERESTARTSYS;
+			break;
+		}
+
+		if (mutex_lock_interruptible(&bus_lock)) {
+			err = -ERESTARTSYS;
+			break;
+		}
+
+		// Sleep until the state machine has timed the start pulse and captured the reply
+		bucket = load_bucket();
+		dev->load_tries[bucket]++;
+		this_cpu_inc(dev->stats->count[DHT11_STAT_TRANSACTIONS]);
+		if (retry)
+			this_cpu_inc(dev->stats->count[DHT11_STAT_RETRIES]);
+		busy_ns = dev->busy_ns;
+		start_transaction(dev);
+		if (wait_for_completion_interruptible(&dev->done)) {
+			cancel_transaction(dev);
+			mutex_unlock(&bus_lock);
+			err = -ERESTARTSYS;
+			break;
+		}
+		// The frame can end before the capture window, make sure the timer is idle
+		hrtimer_cancel(&dev->timer);
+		dht11_backends[dev->backend].end(dev);
+		mutex_unlock(&bus_lock);
+		duration_us = div_u64(ktime_get_ns() - dev->last_start_ns, NSEC_PER_USEC);
+		this_cpu_inc(dev->stats->transaction_us[log2_bucket(duration_us)]);
+
+		backend_stats = &dev->backend_stats[dev->backend];
+		backend_stats->tries++;
+		backend_stats->busy_ns += dev->busy_ns - busy_ns;
+		if (dev->irq_off_ns > backend_stats->irq_off_max_ns)
+			backend_stats->irq_off_max_ns = dev->irq_off_ns;
+
+		memcpy(sample->data, dht, sizeof(sample->data));
+		sample->stamp = ktime_get();
+		sample->retries = retry;
+		sample->type = dev->type;
+		decode_values(sample->type, dht, &sample->humidity, &sample->temperature);
+
+		// Check if the read results are valid. If not then try again!
+		good = dht11_checksum_ok(dht);
+		trace_dht11_transaction(dev->pin, retry, dev->frame.nbits, good, duration_us);
+		trace_add(dev, good);
+		if (good) {
+			dev->load_good[bucket]++;
+			backend_stats->good++;
+			this_cpu_inc(dev->stats->count[DHT11_STAT_GOOD]);
+			dht11_calibrate(&dev->cal, &dev->frame);
+			if (dev->type == DHT11_TYPE_AUTO) {
+				dev->type = detect_type(dht);
+				printk(KERN_INFO DHT11_DRIVER_NAME ": %s on GPIO %d is a DHT%d\n",
+					   dev->name, dev->pin, dev->type);
+			}
+			sample->type = dev->type;
+		}
+
+		// A good frame still has to get past the filters before it is published
+		if (good && filter_sample(dev, sample) == 0) {
+			sample_metrics(sample);
+			sample->status = DHT11_STATUS_OK;
+			sample->valid = 1;
+
+			spin_lock_irqsave(&dev->latest_lock, flags);
+			sample->seq = ++dev->sample_seq;
+			dev->latest = *sample;
+			dev->failed = 0;
+			aggregate_add(dev, sample);
+			changed = alarm_update(dev, sample);
+			alarms = dev->alarms;
+			spin_unlock_irqrestore(&dev->latest_lock, flags);
+
+			history_add(dev, sample);
+			dht11_genl_publish(dev, sample);
+			if (changed)
+				alarm_notify(dev, alarms);
+			wake_up_interruptible(&dev->sample_wait);
+			err = 0;
+			break;
+		}
+
+		if (good) {
+			sample->status = DHT11_STATUS_OUTLIER;
+			this_cpu_inc(dev->stats->count[DHT11_STAT_OUTLIERS]);
+		} else {
+			sample->status = DHT11_STATUS_CHECKSUM;
+			if (dev->frame.nbits == DHT11_FRAME_BITS)
+				this_cpu_inc(dev->stats->count[DHT11_STAT_CHECKSUM]);
+		}
+		if (++retry >= tries) {
+			err = -EIO;
+			break;
+		}
+		if (stale_ok && get_stale(dev, sample)) {
+			err = -EAGAIN;
+			break;
+		}
+		if (msleep_interruptible(retry_backoff())) {
+			err = -ERESTARTSYS;
+			break;
+		}
+	}
+
+	if (err == -EIO || err == -EAGAIN) {
+		spin_lock_irqsave(&dev->latest_lock, flags);
+		dev->failed = 1;
+		spin_unlock_irqrestore(&dev->latest_lock, flags);
+	}
+
+	last_cpu_ns = dev->busy_ns;
+
+	// Callers that waited for acquire_lock meanwhile share this result
+	dev->shared = *sample;
+	dev->shared_err = err;
+	WRITE_ONCE(dev->shared_gen, dev->shared_gen + 1);
+
+	return err;
+}
+
+/*
+ * Background sampler, keeps the cached reading fresh when sample_ms is set.
+ * Each sensor keeps the phase it was given at load time: the next sample is
+ * due sample_ms after the previous one was due, not after it finished, so
+ * waiting for bus_lock does not pile the sensors up on the same slot.
+ */
+static void sample_work_func(struct work_struct *work)
+{
+	struct dht11_dev *dev = container_of(to_delayed_work(work), struct dht11_dev, sample_work);
+	struct dht11_sample sample;
+	unsigned long period;
+
+	mutex_lock(&dev->acquire_lock);
+	dht11_acquire(dev, &sample, 0, 0);
+	mutex_unlock(&dev->acquire_lock);
+
+	period = msecs_to_jiffies(max_t(unsigned int, sample_ms, min_interval_ms(dev)));
+	dev->next_sample += period;
+	while (time_after_eq(jiffies, dev->next_sample))
+		dev->next_sample += period;		// Overran, skip the missed slots
+	schedule_delayed_work(&dev->sample_work, dev->next_sample - jiffies);
+}
+
+/*
+ * Background retries for an open that was handed a stale sample. A good
+ * sample is published as usual, so poll() tells the reader it is in.
+ */
+static void retry_work_func(struct work_struct *work)
+{
+	struct dht11_dev *dev = container_of(to_delayed_work(work), struct dht11_dev, retry_work);
+	struct dht11_sample sample;
+
+	mutex_lock(&dev->acquire_lock);
+	dht11_acquire(dev, &sample, 1, 0);
+	mutex_unlock(&dev->acquire_lock);
+}
+
+/*
+ * Start an acquisition unless one finished while the caller waited for
+ * acquire_lock, then that result is shared. gen is dev->shared_gen from
+ * before the caller tried to take the lock. Results that only hold for
+ * their own caller, an interrupted wait or a stale sample, are not shared.
+ */
+static int join_or_acquire(struct dht11_dev *dev, struct dht11_sample *sample, u32 gen, int stale_ok)
+{
+	if (dev->shared_gen == gen || (dev->shared_err && dev->shared_err != -EIO))
+		return dht11_acquire(dev, sample, 0, stale_ok);
+
+	*sample = dev->shared;
+	return dev->shared_err;
+}
+
+static int sample_fresh(const struct dht11_sample *sample, unsigned int max_age_ms)
+{
+	return sample->valid && ktime_to_ms(ktime_sub(ktime_get(), sample->stamp)) < max_age_ms;
+}
+
+/*
+ * The latest good sample if it is younger than max_age_ms, a new one
+ * otherwise. Concurrent callers wait for a single acquisition and all get
+ * its result, the sensor's minimum interval is kept by dht11_acquire().
+ */
+static int shared_sample(struct dht11_dev *dev, struct dht11_sample *sample, unsigned int max_age_ms)
+{
+	unsigned long flags;
+	u32 gen = READ_ONCE(dev->shared_gen);
+	int err = 0;
+
+	spin_lock_irqsave(&dev->latest_lock, flags);
+	*sample = dev->latest;
+	spin_unlock_irqrestore(&dev->latest_lock, flags);
+
+	if (sample_fresh(sample, max_age_ms))
+		return 0;
+
+	if (mutex_lock_interruptible(&dev->acquire_lock))
+		return -ERESTARTSYS;
+
+	spin_lock_irqsave(&dev->latest_lock, flags);
+	*sample = dev->latest;
+	spin_unlock_irqrestore(&dev->latest_lock, flags);
+
+	if (!sample_fresh(sample, max_age_ms))
+		err = join_or_acquire(dev, sample, gen, 0);
+
+	mutex_unlock(&dev->acquire_lock);
+	return err;
+}
+
+/*
+ * The latest good sample if it is younger than max_age_ms, or at any age
+ * while the background sampler keeps it fresh, a new transaction otherwise.
+ * For interfaces that are polled, callers faster than the sensor get the
+ * same sample again instead of queueing up transactions.
+ */
+static int cached_sample(struct dht11_dev *dev, struct dht11_sample *sample, unsigned int max_age_ms)
+{
+	return shared_sample(dev, sample, sample_ms ? UINT_MAX : max_age_ms);
+}
+
+// DHT11_IOC_READ: a sample no older than read.max_age_ms, at least the sensor's minimum interval
+static long read_shared(struct dht11_dev *dev, struct dht11_read __user *arg)
+{
+	struct dht11_sample sample;
+	struct dht11_read read;
+	int err;
+
+	if (copy_from_user(&read, arg, sizeof(read)))
+		return -EFAULT;
+
+	err = shared_sample(dev, &sample, max_t(unsigned int, read.max_age_ms, min_interval_ms(dev)));
+	if (err < 0)
+		return err;
+
+	fill_record(&read.record, &sample);
+	if (copy_to_user(arg, &read, sizeof(read)))
+		return -EFAULT;
+
+	return 0;
+}
+
+#if DHT11_IIO
+/*
+ * Industrial I/O interface, one IIO device per sensor with a temperature
+ * and a humidity channel in 0.1 units and a triggered buffer, so the
+ * standard IIO tools can stream timestamped samples from any trigger. A
+ * sample is reused until the sensor can be read again.
+ */
+enum dht11_iio_channel {
+	DHT11_IIO_TEMP,
+	DHT11_IIO_HUMIDITY,
+	DHT11_IIO_TIMESTAMP,
+};
+
+#define DHT11_IIO_CHANNEL(_type, _index) {							\
+	.type = (_type),												\
+	.info_mask_separate = BIT(IIO_CHAN_INFO_RAW) | BIT(IIO_CHAN_INFO_SCALE),	\
+	.scan_index = (_index),											\
+	.scan_type = {													\
+		.sign = 's',												\
+		.realbits = 16,												\
+		.storagebits = 16,											\
+		.endianness = IIO_CPU,										\
+	},																\
+}
+
+static const struct iio_chan_spec dht11_iio_channels[] = {
+	DHT11_IIO_CHANNEL(IIO_TEMP, DHT11_IIO_TEMP),
+	DHT11_IIO_CHANNEL(IIO_HUMIDITYRELATIVE, DHT11_IIO_HUMIDITY),
+	IIO_CHAN_SOFT_TIMESTAMP(DHT11_IIO_TIMESTAMP),
+};
+
+static struct dht11_dev *iio_to_dev(struct iio_dev *indio_dev)
+{
+	return *(struct dht11_dev **) iio_priv(indio_dev);
+}
+
+static int dht11_iio_read_raw(struct iio_dev *indio_dev, struct iio_chan_spec const *chan,
+							  int *val, int *val2, long mask)
+{
+	struct dht11_sample sample;
+	int err;
+
+	switch (mask) {
+		case IIO_CHAN_INFO_RAW:
+			err = cached_sample(iio_to_dev(indio_dev), &sample, min_interval_ms(iio_to_dev(indio_dev)));
+			if (err < 0)
+				return err;
+			*val = chan->type == IIO_TEMP ? sample.temperature : sample.humidity;
+			return IIO_VAL_INT;
+		case IIO_CHAN_INFO_SCALE:
+			// 0.1 degree C and 0.1 %RH, IIO wants milli degree C and milli percent
+			*val = 100;
+			return IIO_VAL_INT;
+		default:
+			return -EINVAL;
+	}
+}
+
+static const struct iio_info dht11_iio_info = {
+	.driver_module = THIS_MODULE,
+	.read_raw = dht11_iio_read_raw,
+};
+
+// Bottom half of the trigger, runs in a thread so it can wait for a transaction
+static irqreturn_t dht11_iio_trigger_handler(int irq, void *p)
+{
+	struct iio_poll_func *pf = p;
+	struct iio_dev *indio_dev = pf->indio_dev;
+	struct dht11_sample sample;
+	s16 values[DHT11_IIO_TIMESTAMP];
+	struct {
+		s16 channels[DHT11_IIO_TIMESTAMP];
+		s64 timestamp __aligned(8);
+	} scan;
+	int bit, n = 0;
+
+	if (cached_sample(iio_to_dev(indio_dev), &sample, min_interval_ms(iio_to_dev(indio_dev))) == 0) {
+		values[DHT11_IIO_HUMIDITY] = sample.humidity;
+		values[DHT11_IIO_TEMP] = sample.temperature;
+		memset(&scan, 0, sizeof(scan));
+		for (bit = 0; bit < DHT11_IIO_TIMESTAMP; bit++) {
+			if (test_bit(bit, indio_dev->active_scan_mask))
+				scan.channels[n++] = values[bit];
+		}
+		iio_push_to_buffers_with_timestamp(indio_dev, &scan, pf->timestamp);
+	}
+
+	iio_trigger_notify_done(indio_dev->trig);
+	return IRQ_HANDLED;
+}
+
+static int dht11_iio_register(struct dht11_dev *dev, struct device *parent)
+{
+	struct iio_dev *indio_dev;
+	int err;
+
+	indio_dev = iio_device_alloc(sizeof(dev));
+	if (!indio_dev)
+		return -ENOMEM;
+
+	*(struct dht11_dev **) iio_priv(indio_dev) = dev;
+	indio_dev->dev.parent = parent;
+	indio_dev->name = dev->name;
+	indio_dev->info = &dht11_iio_info;
+	indio_dev->modes = INDIO_DIRECT_MODE;
+	indio_dev->channels = dht11_iio_channels;
+	indio_dev->num_channels = ARRAY_SIZE(dht11_iio_channels);
+
+	err = iio_triggered_buffer_setup(indio_dev, iio_pollfunc_store_time,
+									 dht11_iio_trigger_handler, NULL);
+	if (err < 0)
+		goto exit_free;
+
+	err = iio_device_register(indio_dev);
+	if (err < 0)
+		goto exit_buffer;
+
+	dev->iio = indio_dev;
+	return 0;
+
+exit_buffer:
+	iio_triggered_buffer_cleanup(indio_dev);
+exit_free:
+	iio_device_free(indio_dev);
+	return err;
+}
+
+static void dht11_iio_unregister(struct dht11_dev *dev)
+{
+	if (!dev->iio)
+		return;
+
+	iio_device_unregister(dev->iio);
+	iio_triggered_buffer_cleanup(dev->iio);
+	iio_device_free(dev->iio);
+	dev->iio = NULL;
+}
+#else
+static int dht11_iio_register(struct dht11_dev *dev, struct device *parent)
+{
+	return 0;
+}
+
+static void dht11_iio_unregister(struct dht11_dev *dev)
+{
+}
+#endif
+
+#if DHT11_HWMON
+/*
+ * hwmon interface for lm-sensors, served from the cached sample so that
+ * monitoring daemons polling it do not talk to the sensor each time.
+ */
+static int hwmon_values(struct device *device, s16 *humidity, s16 *temperature)
+{
+	struct dht11_dev *dev = dev_get_drvdata(device);
+	struct dht11_sample sample;
+	int err;
+
+	err = cached_sample(dev, &sample, max_t(int, hwmon_cache_ms, min_interval_ms(dev)));
+	if (err < 0)
+		return err;
+
+	*humidity = sample.humidity;
+	*temperature = sample.temperature;
+	return 0;
+}
+
+static ssize_t temp1_input_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+	s16 humidity, temperature;
+	int err;
+
+	err = hwmon_values(device, &humidity, &temperature);
+	if (err < 0)
+		return err;
+
+	return sprintf(buf, "%d\n", temperature * 100);		// milli degree C
+}
+
+static ssize_t humidity1_input_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+	s16 humidity, temperature;
+	int err;
+
+	err = hwmon_values(device, &humidity, &temperature);
+	if (err < 0)
+		return err;
+
+	return sprintf(buf, "%d\n", humidity * 100);			// milli percent
+}
+
+// The hwmon name can not have a '-', the label tells the sensors apart
+static ssize_t temp1_label_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+	struct dht11_dev *dev = dev_get_drvdata(device);
+
+	return sprintf(buf, "%s\n", dev->name);
+}
+
+static DEVICE_ATTR(temp1_input, S_IRUGO, temp1_input_show, NULL);
+static DEVICE_ATTR(temp1_label, S_IRUGO, temp1_label_show, NULL);
+static DEVICE_ATTR(humidity1_input, S_IRUGO, humidity1_input_show, NULL);
+
+static struct attribute *dht11_hwmon_attrs[] = {
+	&dev_attr_temp1_input.attr,
+	&dev_attr_temp1_label.attr,
+	&dev_attr_humidity1_input.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(dht11_hwmon);
+
+static int dht11_hwmon_register(struct dht11_dev *dev, struct device *parent)
+{
+	struct device *hwmon;
+
+	hwmon = hwmon_device_register_with_groups(parent, DHT11_DRIVER_NAME, dev, dht11_hwmon_groups);
+	if (IS_ERR(hwmon))
+		return PTR_ERR(hwmon);
+
+	dev->hwmon = hwmon;
+	return 0;
+}
+
+static void dht11_hwmon_unregister(struct dht11_dev *dev)
+{
+	if (!dev->hwmon)
+		return;
+
+	hwmon_device_unregister(dev->hwmon);
+	dev->hwmon = NULL;
+}
+#else
+static int dht11_hwmon_register(struct dht11_dev *dev, struct device *parent)
+{
+	return 0;
+}
+
+static void dht11_hwmon_unregister(struct dht11_dev *dev)
+{
+}
+#endif
+
+// Format a reading in the layout selected by the format parameter
+static int format_reading(char *buf, const struct dht11_sample *sample, const char *result)
+{
+	const unsigned char *data = sample->data;
+	s16 humidity, temperature;
+
+	switch(format){
+		case 1:
+			return sprintf(buf, "%0X,%0X,%0X,%0X,%0X,%s\n", data[0], data[1], data[2], data[3], data[4], result);
+		case 2:
+			return sprintf(buf, "%02X%02X%02X%02X%02X%s\n", data[0], data[1], data[2], data[3], data[4], result);
+		case 3:
+			decode_values(sample->type, data, &humidity, &temperature);
+			return sprintf(buf, "Temperature: %s%d.%dC\nHumidity: %d.%d%%\nResult:%s\n",
+						   temperature < 0 ? "-" : "", abs(temperature) / 10, abs(temperature) % 10,
+						   humidity / 10, humidity % 10, result);
+		case 4:
+			decode_values(sample->type, data, &humidity, &temperature);
+			return sprintf(buf, "Temperature: %s%d.%dC (filtered %s%d.%dC)\nHumidity: %d.%d%% (filtered %d.%d%%)\nResult:%s\n",
+						   temperature < 0 ? "-" : "", abs(temperature) / 10, abs(temperature) % 10,
+						   sample->temperature < 0 ? "-" : "", abs(sample->temperature) / 10,
+						   abs(sample->temperature) % 10, humidity / 10, humidity % 10,
+						   sample->humidity / 10, sample->humidity % 10, result);
+		case 5:
+			return sprintf(buf, "Dew point: %s%d.%dC\nHeat index: %s%d.%dC\nAbsolute humidity: %d.%02dg/m3\nResult:%s\n",
+						   sample->dew_point < 0 ? "-" : "", abs(sample->dew_point) / 10,
+						   abs(sample->dew_point) % 10, sample->heat_index < 0 ? "-" : "",
+						   abs(sample->heat_index) / 10, abs(sample->heat_index) % 10,
+						   sample->abs_humidity / 100, sample->abs_humidity % 100, result);
+		default:
+			return sprintf(buf, "Values: %d, %d, %d, %d, %d, %s\n", data[0], data[1], data[2], data[3], data[4], result);
+	}
+}
+
+// Sequence number of the newest good sample
+static u32 latest_seq(struct dht11_dev *dev)
+{
+	unsigned long flags;
+	u32 seq;
+
+	spin_lock_irqsave(&dev->latest_lock, flags);
+	seq = dev->latest.seq;
+	spin_unlock_irqrestore(&dev->latest_lock, flags);
+
+	return seq;
+}
+
+// Result shown by the text formats
+static const char *status_name(u8 status)
+{
+	switch (status) {
+		case DHT11_STATUS_OK:
+			return "OK";
+		case DHT11_STATUS_STALE:
+			return "STALE";
+		case DHT11_STATUS_OUTLIER:
+			return "OUTLIER";
+		default:
+			return "BAD";
+	}
+}
+
+// Make a sample the one handed out by the next reads on this file
+static void reader_load(struct dht11_reader *reader, const struct dht11_sample *sample)
+{
+	int len;
+
+	if (sample != &reader->sample)
+		reader->sample = *sample;
+
+	len = format_reading(reader->msg, sample, status_name(sample->status));
+	if (sample_ms || sample->status == DHT11_STATUS_STALE)
+		snprintf(reader->msg + len, BUF_LEN - len, "Age: %lldms\n",
+				 ktime_to_ms(ktime_sub(ktime_get(), sample->stamp)));
+	reader->msg_Ptr = reader->msg;
+	reader->pending = 1;
+}
+
+/*
+ * Load the newest good sample if this file has not seen it yet. It is
+ * marked stale when the sampler has failed to read the sensor since.
+ */
+static int reader_next(struct dht11_reader *reader)
+{
+	struct dht11_dev *dev = reader->dev;
+	struct dht11_sample sample;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->latest_lock, flags);
+	sample = dev->latest;
+	if (dev->failed)
+		sample.status = DHT11_STATUS_STALE;
+	spin_unlock_irqrestore(&dev->latest_lock, flags);
+
+	if (!sample.valid || sample.seq == reader->last_seq)
+		return 0;
+
+	reader_load(reader, &sample);
+	reader->last_seq = sample.seq;
+
+	return 1;
+}
+
+/*
+ * /proc/dht11 and /proc/dht11.csv: the history rings of all sensors, oldest
+ * record first, one line each, after a header line. They are seq_files, so
+ * a dump goes out a page per copy and never touches the sensors. Records
+ * are copied out one at a time under the ring's seq count, samples taken
+ * while a dump runs are included, overwritten ones are skipped.
+ */
+struct history_iter {
+	int csv;
+	int sensor;					// Sensor of the current record
+	u32 seq;					// Its sequence number
+	loff_t pos;					// Its position, the header is 0
+	struct dht11_record rec;
+};
+
+// Copy the record at it->sensor, it->seq, or the next one there is
+static void *history_iter_load(struct history_iter *it)
+{
+	for (; it->sensor < nsensors; it->sensor++, it->seq = 0) {
+		if (history_get(&sensors[it->sensor], &it->seq, &it->rec) == 0)
+			return it;
+	}
+
+	return NULL;
+}
+
+static void *history_seq_start(struct seq_file *m, loff_t *pos)
+{
+	struct history_iter *it = m->private;
+
+	if (*pos == 0)
+		return SEQ_START_TOKEN;
+
+	// Reads carry on where the last one stopped, anything else walks from the start
+	if (*pos != it->pos) {
+		it->sensor = 0;
+		it->seq = 0;
+		for (it->pos = 1; it->pos < *pos; it->pos++) {
+			if (!history_iter_load(it))
+				return NULL;
+			it->seq++;
+		}
+	}
+
+	return history_iter_load(it);
+}
+
+static void *history_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	struct history_iter *it = m->private;
+
+	if (v == SEQ_START_TOKEN) {
+		it->sensor = 0;
+		it->seq = 0;
+	} else {
+		it->seq++;
+	}
+	it->pos = ++*pos;
+
+	return history_iter_load(it);
+}
+
+static void history_seq_stop(struct seq_file *m, void *v)
+{
+}
+
+// Print value / 10^decimals with the decimals, i.e. 0.1 units as 12.3
+static void seq_fixed(struct seq_file *m, char sep, int value, int decimals)
+{
+	int div = decimals == 2 ? 100 : 10;
+
+	seq_printf(m, "%c%s%d.%0*d", sep, value < 0 ? "-" : "", abs(value) / div, decimals, abs(value) % div);
+}
+
+static int history_seq_show(struct seq_file *m, void *v)
+{
+	struct history_iter *it = m->private;
+	const struct dht11_record *rec = &it->rec;
+	struct dht11_dev *dev;
+	char sep = it->csv ? ',' : ' ';
+
+	if (v == SEQ_START_TOKEN) {
+		seq_printf(m, "%ssensor%cgpio%cseq%ctimestamp_ns%cstatus%chumidity%ctemperature"
+				   "%chumidity_filtered%ctemperature_filtered%cdew_point%cheat_index%cabs_humidity%craw\n",
+				   it->csv ? "" : "# ", sep, sep, sep, sep, sep, sep, sep, sep, sep, sep, sep, sep);
+		return 0;
+	}
+
+	dev = &sensors[it->sensor];
+	seq_printf(m, "%s%c%d%c%u%c%llu%c%s", dev->name, sep, dev->pin, sep, le32_to_cpu(rec->seq), sep,
+			   (unsigned long long) le64_to_cpu(rec->timestamp_ns), sep, status_name(rec->status));
+	seq_fixed(m, sep, (s16) le16_to_cpu(rec->humidity), 1);
+	seq_fixed(m, sep, (s16) le16_to_cpu(rec->temperature), 1);
+	seq_fixed(m, sep, (s16) le16_to_cpu(rec->humidity_filtered), 1);
+	seq_fixed(m, sep, (s16) le16_to_cpu(rec->temperature_filtered), 1);
+	seq_fixed(m, sep, (s16) le16_to_cpu(rec->dew_point), 1);
+	seq_fixed(m, sep, (s16) le16_to_cpu(rec->heat_index), 1);
+	seq_fixed(m, sep, le16_to_cpu(rec->abs_humidity), 2);
+	seq_printf(m, "%c%02x%02x%02x%02x%02x\n", sep,
+			   rec->raw[0], rec->raw[1], rec->raw[2], rec->raw[3], rec->raw[4]);
+
+	return 0;
+}
+
+static const struct seq_operations history_seq_ops = {
+	.start = history_seq_start,
+	.next = history_seq_next,
+	.stop = history_seq_stop,
+	.show = history_seq_show,
+};
+
+static int history_open(struct inode *inode, struct file *file, int csv)
+{
+	struct history_iter *it;
+
+	it = __seq_open_private(file, &history_seq_ops, sizeof(*it));
+	if (!it)
+		return -ENOMEM;
+
+	it->csv = csv;
+	return 0;
+}
+
+static int proc_history_open(struct inode *inode, struct file *file)
+{
+	return history_open(inode, file, 0);
+}
+
+static int proc_csv_open(struct inode *inode, struct file *file)
+{
+	return history_open(inode, file, 1);
+}
+
+static const struct file_operations proc_history_fops = {
+	.owner = THIS_MODULE,
+	.open = proc_history_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = seq_release_private,
+};
+
+static const struct file_operations proc_csv_fops = {
+	.owner = THIS_MODULE,
+	.open = proc_csv_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = seq_release_private,
+};
+
+// Initialise GPIO memory
+static int init_port(void)
+{
+	// reserve GPIO memory region.
+	if (request_mem_region(GPIO_BASE, SZ_4K, DHT11_DRIVER_NAME)) {
+		printk(KERN_ERR DHT11_DRIVER_NAME ": unable to obtain GPIO I/O memory address\n");
+		return -EBUSY;
+	}
+
+	// remap the GPIO memory
+	if ((gpio = ioremap_nocache(GPIO_BASE, SZ_4K)) == NULL) {
+		printk(KERN_ERR DHT11_DRIVER_NAME ": failed to map GPIO I/O memory!\n");
+		return -EBUSY;
+	}
+
+	return 0;
+}
+
+// Check a pin against the list of usable GPIO pins
+static int valid_pin(int pin)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(valid_gpio_pins); i++) {
+		if (pin == valid_gpio_pins[i])
+			return 1;
+	}
+
+	return 0;
+}
+
+// Set up the state of one sensor, nothing that needs undoing but the history
+static int sensor_init(struct dht11_dev *dev, int id, int pin, int type)
+{
+	int i, w;
+
+	dev->id = id;
+	dev->pin = pin;
+	dev->type = type;
+	if (nsensors == 1)
+		snprintf(dev->name, sizeof(dev->name), DHT11_DRIVER_NAME);
+	else
+		snprintf(dev->name, sizeof(dev->name), DHT11_DRIVER_NAME "-%d", id);
+
+	dev->state = DHT11_IDLE;
+	init_completion(&dev->done);
+	hrtimer_init(&dev->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	dev->timer.function = dht11_timer_func;
+	tasklet_init(&dev->decode_tasklet, decode_tasklet_func, (unsigned long) dev);
+
+	dht11_cal_init(&dev->cal);
+	mutex_init(&dev->trace_lock);
+
+	spin_lock_init(&dev->latest_lock);
+	mutex_init(&dev->acquire_lock);
+	INIT_DELAYED_WORK(&dev->sample_work, sample_work_func);
+	INIT_DELAYED_WORK(&dev->retry_work, retry_work_func);
+	init_waitqueue_head(&dev->sample_wait);
+	for (w = 0; w < nagg_windows; w++)
+		dev->windows[w].bucket_ms = agg_windows[w] * MSEC_PER_SEC / DHT11_AGG_BUCKETS;
+	for (i = 0; i < DHT11_FILTER_VALUES; i++) {
+		dev->limits[i][DHT11_LIMIT_LOW] = DHT11_THRESHOLD_OFF;
+		dev->limits[i][DHT11_LIMIT_HIGH] = DHT11_THRESHOLD_OFF;
+		dev->limits[i][DHT11_LIMIT_HYST] = DHT11_DEFAULT_HYST;
+	}
+
+	dev->stats = alloc_percpu(struct dht11_stats);
+	if (!dev->stats)
+		return -ENOMEM;
+
+	dev->traces = kcalloc(DHT11_TRACE_FRAMES, sizeof(*dev->traces), GFP_KERNEL);
+	if (!dev->traces)
+		return -ENOMEM;
+
+	// debugfs is optional, the driver works without the files
+	dev->debugfs = debugfs_create_dir(dev->name, debugfs_root);
+	debugfs_create_file("stats", S_IRUGO | S_IWUSR, dev->debugfs, dev, &stats_fops);
+	debugfs_create_file("histograms", S_IRUGO, dev->debugfs, dev, &histograms_fops);
+	debugfs_create_file("edges", S_IRUGO, dev->debugfs, dev, &edges_fops);
+
+	return history_init(dev);
+}
+
+// Stop the sampler and anything still in flight on a sensor
+static void sensor_stop(struct dht11_dev *dev)
+{
+	cancel_delayed_work_sync(&dev->sample_work);
+	cancel_delayed_work_sync(&dev->retry_work);
+	hrtimer_cancel(&dev->timer);
+	tasklet_kill(&dev->decode_tasklet);
+}
+
+// Remove a sensor's class device, alarm_notify() checks for it with acquire_lock held
+static void sensor_device_destroy(struct dht11_dev *dev)
+{
+	mutex_lock(&dev->acquire_lock);
+	dev->device = NULL;
+	mutex_unlock(&dev->acquire_lock);
+
+	device_destroy(dht11_class, MKDEV(dev_major, dev->id));
+}
+
+static int __init dht11_init(void)
+{
+	struct device *device;
+	struct dht11_dev *dev;
+	int result;
+	int type;
+	int i, j;
+
+	// One sensor on gpio_pin unless a list of pins was given
+	if (ngpio_pins == 0) {
+		gpio_pins[0] = gpio_pin;
+		ngpio_pins = 1;
+	}
+	nsensors = ngpio_pins;
+
+	// check for valid gpio pin numbers, each pin can only have one sensor
+	for (i = 0; i < nsensors; i++) {
+		if (!valid_pin(gpio_pins[i])) {
+			printk(KERN_ERR DHT11_DRIVER_NAME ": invalid GPIO pin %d specified!\n", gpio_pins[i]);
+			return -EINVAL;
+		}
+		for (j = 0; j < i; j++) {
+			if (gpio_pins[j] == gpio_pins[i]) {
+				printk(KERN_ERR DHT11_DRIVER_NAME ": GPIO pin %d given twice!\n", gpio_pins[i]);
+				return -EINVAL;
+			}
+		}
+	}
+
+	for (i = 0; i < nsensor_types; i++) {
+		type = sensor_types[i];
+		if (type != DHT11_TYPE_AUTO && type != DHT11_TYPE_DHT11 && !is_dht22(type)) {
+			printk(KERN_ERR DHT11_DRIVER_NAME ": invalid sensor type %d specified!\n", type);
+			return -EINVAL;
+		}
+	}
+
+	// Aggregate windows of a minute, five minutes and an hour unless given
+	if (nagg_windows == 0) {
+		agg_windows[0] = 60;
+		agg_windows[1] = 300;
+		agg_windows[2] = 3600;
+		nagg_windows = 3;
+	}
+	for (i = 0; i < nagg_windows; i++) {
+		if (agg_windows[i] < 1 || agg_windows[i] > 7 * 24 * 3600) {
+			printk(KERN_ERR DHT11_DRIVER_NAME ": invalid aggregate window %ds specified!\n", agg_windows[i]);
+			return -EINVAL;
+		}
+	}
+
+	spin_lock_init(&lock);
+
+	sensors = kcalloc(nsensors, sizeof(*sensors), GFP_KERNEL);
+	if (!sensors)
+		return -ENOMEM;
+
+	debugfs_root = debugfs_create_dir(DHT11_DRIVER_NAME, NULL);
+
+	for (i = 0; i < nsensors; i++) {
+		type = i < nsensor_types ? sensor_types[i] : DHT11_TYPE_DHT11;
+		result = sensor_init(&sensors[i], i, gpio_pins[i], type);
+		if (result < 0)
+			goto exit_sensors;
+	}
+
+	result = alloc_chrdev_region(&dev_number, 0, nsensors, DHT11_DRIVER_NAME);
+
+	if (result < 0) {
+		printk(KERN_ALERT DHT11_DRIVER_NAME ": Registering dht11 driver failed with %d\n", result);
+		goto exit_sensors;
+	}
+
+	dev_major = MAJOR(dev_number);
+
+	dht11_class = class_create(THIS_MODULE, DHT11_DRIVER_NAME);
+	if (IS_ERR(dht11_class)) {
+		result = PTR_ERR(dht11_class);
+		goto exit_region;
+	}
+
+	result = init_port();
+	if (result < 0)
+		goto exit_class;
+
+	for (i = 0; i < nsensors; i++) {
+		result = setup_interrupts(&sensors[i]);
+		if (result < 0)
+			goto exit_irqs;
+	}
+
+	// Before the device nodes, every sample taken through them is published to it
+	result = dht11_genl_register();
+	if (result < 0) {
+		printk(KERN_ALERT DHT11_DRIVER_NAME ": Error %d registering the netlink family\n", result);
+		goto exit_irqs;
+	}
+
+	// The device nodes go last, nothing can open a sensor before it is set up
+	for (i = 0; i < nsensors; i++) {
+		dev = &sensors[i];
+		cdev_init(&dev->cdev, &fops);
+		dev->cdev.owner = THIS_MODULE;
+
+		result = cdev_add(&dev->cdev, MKDEV(dev_major, i), 1);
+		if (result < 0) {
+			printk(KERN_ALERT DHT11_DRIVER_NAME ": Error %d adding cdev\n", result);
+			goto exit_devices;
+		}
+
+		device = device_create_with_groups(dht11_class, NULL, MKDEV(dev_major, i), dev,
+										   dht11_alarm_groups, dev->name);
+		if (IS_ERR(device)) {
+			cdev_del(&dev->cdev);
+			result = -ENODEV;
+			goto exit_devices;
+		}
+		dev->device = device;
+
+		result = dht11_iio_register(dev, device);
+		if (result < 0) {
+			printk(KERN_ALERT DHT11_DRIVER_NAME ": Error %d registering the IIO device\n", result);
+			sensor_device_destroy(dev);
+			cdev_del(&dev->cdev);
+			goto exit_devices;
+		}
+
+		result = dht11_hwmon_register(dev, device);
+		if (result < 0) {
+			printk(KERN_ALERT DHT11_DRIVER_NAME ": Error %d registering the hwmon device\n", result);
+			dht11_iio_unregister(dev);
+			sensor_device_destroy(dev);
+			cdev_del(&dev->cdev);
+			goto exit_devices;
+		}
+	}
+
+	printk(KERN_INFO DHT11_DRIVER_NAME ": driver registered with %d sensor(s)!\n", nsensors);
+
+	entry = proc_create(DHT11_DRIVER_NAME, 0, NULL, &proc_history_fops);
+	proc_create(DHT11_DRIVER_NAME ".csv", 0, NULL, &proc_csv_fops);
+
+	// Spread the samplers evenly over the period so their transactions take turns
+	if (sample_ms) {
+		if (sample_ms < DHT11_MIN_INTERVAL_MS)
+			sample_ms = DHT11_MIN_INTERVAL_MS;
+		for (i = 0; i < nsensors; i++) {
+			dev = &sensors[i];
+			dev->next_sample = jiffies + msecs_to_jiffies(sample_ms / nsensors * i);
+			schedule_delayed_work(&dev->sample_work, dev->next_sample - jiffies);
+		}
+	}
+
+	return 0;
+
+exit_devices:
+	while (i--) {
+		dht11_hwmon_unregister(&sensors[i]);
+		dht11_iio_unregister(&sensors[i]);
+		sensor_device_destroy(&sensors[i]);
+		cdev_del(&sensors[i].cdev);
+	}
+	dht11_genl_unregister();
+exit_irqs:
+	for (i = 0; i < nsensors; i++)
+		clear_interrupts(&sensors[i]);
+	iounmap(gpio);
+exit_class:
+	class_destroy(dht11_class);
+exit_region:
+	unregister_chrdev_region(dev_number, nsensors);
+exit_sensors:
+	debugfs_remove_recursive(debugfs_root);
+	for (i = 0; i < nsensors; i++) {
+		vfree(sensors[i].history);
+		free_percpu(sensors[i].stats);
+		kfree(sensors[i].traces);
+	}
+	kfree(sensors);
+	return result;
+}
+
+static void __exit dht11_exit(void)
+{
+	int i;
+
+	remove_proc_entry(DHT11_DRIVER_NAME ".csv", NULL);
+	remove_proc_entry(DHT11_DRIVER_NAME, NULL);
+
+	for (i = 0; i < nsensors; i++) {
+		dht11_hwmon_unregister(&sensors[i]);
+		dht11_iio_unregister(&sensors[i]);
+		sensor_device_destroy(&sensors[i]);
+		cdev_del(&sensors[i].cdev);
+		sensor_stop(&sensors[i]);
+		clear_interrupts(&sensors[i]);
+	}
+	dht11_genl_unregister();
+	class_destroy(dht11_class);
+
+	// release mapped memory and allocated region
+	if (gpio != NULL) {
+		iounmap(gpio);
+		release_mem_region(GPIO_BASE, SZ_4K);
+		printk(DHT11_DRIVER_NAME ": cleaned up resourses\n");
+	}
+
+	debugfs_remove_recursive(debugfs_root);
+	for (i = 0; i < nsensors; i++) {
+		vfree(sensors[i].history);
+		free_percpu(sensors[i].stats);
+		kfree(sensors[i].traces);
+	}
+	kfree(sensors);
+
+	// Unregister the driver
+	unregister_chrdev_region(dev_number, nsensors);
+	printk(DHT11_DRIVER_NAME ": cleaned up module\n");
+}
+
+
+// Sensor behind a device file
+static struct dht11_dev *inode_to_dev(struct inode *inode)
+{
+	return container_of(inode->i_cdev, struct dht11_dev, cdev);
+}
+
+// Called when a process wants to read the dht11 "cat /dev/dht11"
+static int open_dht11(struct inode *inode, struct file *file)
+{
+	struct dht11_dev *dev = inode_to_dev(inode);
+	struct dht11_reader *reader;
+
+	reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+	if (!reader)
+		return -ENOMEM;
+	reader->dev = dev;
+	reader->msg_Ptr = reader->msg;
+	reader->alarm_changes = alarm_changes(dev);
+
+	trace_dht11_open(dev->pin, sample_ms != 0);
+
+	// Serve the cached reading, only sample_work talks to the sensor.
+	// Before the first good sample there is nothing to read yet. Without
+	// the sampler the first read takes a sample, so a file opened for the
+	// ioctls, poll() or mmap() does not cost a transaction.
+	if (sample_ms)
+		reader_next(reader);
+	else
+		reader->acquire = 1;
+
+	// try_module_get(THIS_MODULE); 		// Increase use count (看起来这是个不用了的功能：http://stackoverflow.com/questions/1741415/linux-kernel-modules-when-to-use-try-module-get-module-put)
+
+	file->private_data = reader;
+
+	return SUCCESS;
+}
+
+// Called when a process closes the device file.
+static int close_dht11(struct inode *inode, struct file *file)
+{
+	struct dht11_reader *reader = file->private_data;
+
+	// Decrement the usage count, or else once you opened the file, you'll never get get rid of the module.
+	// module_put(THIS_MODULE);
+	trace_dht11_release(reader->dev->pin);
+	kfree(reader);
+
+	return 0;
+}
+
+// Release the IRQ at unload, edge detection has already been disabled when the capture window closed
+static void clear_interrupts(struct dht11_dev *dev)
+{
+	if (!dev->irq)
+		return;
+
+	free_irq(dev->irq, dev);
+	irq_clear_status_flags(dev->irq, IRQ_NOAUTOEN);
+	dev->irq = 0;
+}
+
+/*
+ * Take the sample the first read of a file returns when there is no
+ * background sampler. One acquisition per sensor at a time, reads that
+ * come in while it runs wait and share its result. A stale reader does not
+ * wait, it gets the last good sample.
+ */
+static int reader_acquire(struct dht11_reader *reader)
+{
+	struct dht11_dev *dev = reader->dev;
+	u32 gen;
+	int err;
+
+	gen = READ_ONCE(dev->shared_gen);
+	if (!mutex_trylock(&dev->acquire_lock)) {
+		if (retry_policy == DHT11_RETRY_STALE && get_stale(dev, &reader->sample)) {
+			reader_load(reader, &reader->sample);
+			reader->last_seq = reader->sample.seq;
+			return 0;
+		}
+		if (mutex_lock_interruptible(&dev->acquire_lock))
+			return -ERESTARTSYS;
+	}
+
+	// A bad checksum (-EIO) is still reported to the reader as "BAD",
+	// a stale sample (-EAGAIN) as "STALE" while the retries go on
+	err = join_or_acquire(dev, &reader->sample, gen, retry_policy == DHT11_RETRY_STALE);
+	if (err == -EAGAIN)
+		schedule_delayed_work(&dev->retry_work, msecs_to_jiffies(retry_backoff()));
+	else if (err && err != -EIO) {
+		mutex_unlock(&dev->acquire_lock);
+		return err;
+	}
+
+	// Return the result in various different formats
+	reader_load(reader, &reader->sample);
+	reader->last_seq = latest_seq(dev);
+	mutex_unlock(&dev->acquire_lock);
+
+	return 0;
+}
+
+// Called when a process, which already opened the dev file, attempts to read from it.
+static ssize_t read_dht11(struct file *filp,	// see include/linux/fs.h
+							char *buffer,		// buffer to fill with data
+							size_t lenght,		// lenght of the buffer
+							loff_t * offset)
+{
+	struct dht11_reader *reader = filp->private_data;
+	struct dht11_record rec;
+	// Number of bytes actually written to the buffer
+	int bytes_read = 0;
+	int err;
+
+	if (reader->acquire) {
+		err = reader_acquire(reader);
+		if (err < 0)
+			return err;
+		reader->acquire = 0;
+	}
+
+	// If we're at the end of the message and there is no newer sample, return 0
+	// signifying end of file. poll() tells when the next sample is in.
+	if (!reader->pending && !reader_next(reader))
+		return (filp->f_flags & O_NONBLOCK) ? -EAGAIN : 0;
+
+	// Binary mode hands out the whole record in one go, or nothing at all
+	if (reader->format == DHT11_FORMAT_BINARY) {
+		if (lenght < sizeof(rec))
+			return -EINVAL;
+
+		fill_record(&rec, &reader->sample);
+		if (copy_to_user(buffer, &rec, sizeof(rec)))
+			return -EFAULT;
+		reader->pending = 0;
+		trace_dht11_read(reader->dev->pin, reader->format, sizeof(rec));
+
+		return sizeof(rec);
+	}
+
+	// Actually put the data into the buffer
+	while(lenght && *reader->msg_Ptr) {
+		// The buffer is in the user data segment, not the kernel segment so "*" assignment won't work. We have to use
+		// put_user which copies data from the kernel datasegment to the user data segment.
+		put_user(*(reader->msg_Ptr++), buffer++);
+
+		lenght--;
+		bytes_read++;
+	}
+	if (*reader->msg_Ptr == 0)
+		reader->pending = 0;
+	trace_dht11_read(reader->dev->pin, reader->format, bytes_read);
+
+	// Return the number of bytes put into the buffer
+	return bytes_read;
+}
+
+/*
+ * POLLIN when the file has an unread sample or a newer good sample is in,
+ * POLLPRI when the alarms changed since DHT11_IOC_GET_ALARMS on this file
+ */
+static unsigned int poll_dht11(struct file *filp, poll_table *wait)
+{
+	struct dht11_reader *reader = filp->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(filp, &reader->dev->sample_wait, wait);
+
+	if (reader->pending || reader->acquire || latest_seq(reader->dev) != reader->last_seq)
+		mask |= POLLIN | POLLRDNORM;
+	if (alarm_changes(reader->dev) != reader->alarm_changes)
+		mask |= POLLPRI;
+
+	return mask;
+}
+
+// Map the sensor's sample ring read-only into the caller
+static int mmap_dht11(struct file *filp, struct vm_area_struct *vma)
+{
+	struct dht11_reader *reader = filp->private_data;
+
+	if (!reader->dev->history)
+		return -ENODEV;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return remap_vmalloc_range(vma, reader->dev->history, vma->vm_pgoff);
+}
+
+// Per file control, DHT11_IOC_SET_FORMAT picks text or binary records for later reads
+static long ioctl_dht11(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct dht11_reader *reader = filp->private_data;
+	int value;
+
+	switch (cmd) {
+		case DHT11_IOC_SET_FORMAT:
+			if (get_user(value, (int __user *) arg))
+				return -EFAULT;
+			if (value != DHT11_FORMAT_TEXT && value != DHT11_FORMAT_BINARY)
+				return -EINVAL;
+			reader->format = value;
+			return 0;
+		case DHT11_IOC_GET_SAMPLES:
+			return history_get_samples(reader->dev, (struct dht11_batch __user *) arg);
+		case DHT11_IOC_GET_AGGREGATES:
+			return aggregates_get(reader->dev, (struct dht11_aggregates __user *) arg);
+		case DHT11_IOC_SET_THRESHOLDS:
+			return thresholds_set(reader->dev, (const struct dht11_thresholds __user *) arg);
+		case DHT11_IOC_GET_THRESHOLDS:
+			return thresholds_get(reader->dev, (struct dht11_thresholds __user *) arg);
+		case DHT11_IOC_GET_ALARMS:
+			return alarms_get(reader, (struct dht11_alarms __user *) arg);
+		case DHT11_IOC_READ:
+			return read_shared(reader->dev, (struct dht11_read __user *) arg);
+		default:
+			return -ENOTTY;
+	}
+}
+
 MODULE_DESCRIPTION("DHT11 temperature/humidity sensor driver for Raspberry Pi GPIO");
 MODULE_LICENSE("GPL");
 module_init(dht11_init);
 module_exit(dht11_exit);
-	
\ No newline at end of file
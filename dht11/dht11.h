@@ -0,0 +1,296 @@
+/* dht11.h
+ *
+ * Interface shared between the dht11 driver and user space programs.
+ *
+ * By default a read of /dev/dht11 returns a line of text. After
+ * DHT11_IOC_SET_FORMAT with DHT11_FORMAT_BINARY, reads on that file
+ * return struct dht11_record instead, so a program can copy samples
+ * straight into its own buffers without parsing text.
+ *
+ * The driver also keeps the last history_len good samples in a ring that
+ * can be mapped read-only with mmap() on /dev/dht11. The mapping starts
+ * with struct dht11_history, the records follow at data_offset. To copy a
+ * consistent window without a system call:
+ *
+ *	do {
+ *		seq = h->seq;				// odd while the driver updates the ring
+ *		read barrier
+ *		copy h->generation and the wanted records
+ *		read barrier
+ *	} while ((seq & 1) || seq != h->seq);
+ *
+ * Programs that do not map the ring can fetch a batch of it with
+ * DHT11_IOC_GET_SAMPLES, i.e. to catch up after a pause:
+ *
+ *	struct dht11_batch b = { .since_seq = next, .max_records = N,
+ *				 .records = (uintptr_t) array };
+ *	ioctl(fd, DHT11_IOC_GET_SAMPLES, &b);
+ *	next = b.next_seq;		// b.count records are in array
+ *
+ * Alarm daemons set thresholds with DHT11_IOC_SET_THRESHOLDS or the
+ * temp_low, temp_high, ... files in /sys/class/dht11/<device>, then sleep
+ * in poll() for POLLPRI, which is reported once the alarms have changed
+ * since the file last fetched them with DHT11_IOC_GET_ALARMS. The alarm
+ * file in sysfs can be polled the same way, and every change also sends a
+ * change uevent with DHT11_ALARM set to the raised alarms.
+ */
+#ifndef _DHT11_H
+#define _DHT11_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+// Read formats, selected per open file with DHT11_IOC_SET_FORMAT
+#define DHT11_FORMAT_TEXT 0
+#define DHT11_FORMAT_BINARY 1
+
+// Sensor types, the values of the sensor_types module parameter
+#define DHT11_TYPE_AUTO 0			// Detected from the first good frame
+#define DHT11_TYPE_DHT11 11			// Integer humidity and temperature bytes
+#define DHT11_TYPE_DHT21 21			// AM2301, same frame as the DHT22
+#define DHT11_TYPE_DHT22 22			// 16 bit humidity and temperature in 0.1 units
+
+// Sample status
+#define DHT11_STATUS_OK 0			// Checksum matched
+#define DHT11_STATUS_CHECKSUM 1		// Gave up after the retries, checksum did not match
+#define DHT11_STATUS_STALE 2		// Last good sample, the latest read of the sensor failed
+#define DHT11_STATUS_OUTLIER 3		// Checksum matched, but the values jumped more than the filter allows
+
+/*
+ * struct dht11_record - one sample as returned by a binary read
+ * @timestamp_ns:	CLOCK_MONOTONIC time the sample was taken, also for a stale
+ *					sample, so its age is the current time minus this
+ * @seq:			sequence number, incremented for every good sample
+ * @status:			DHT11_STATUS_*
+ * @retries:		number of retries it took to get the sample
+ * @sensor_type:	DHT11_TYPE_* the frame was decoded as
+ * @raw:			the 5 bytes sent by the sensor, checksum last
+ * @humidity:		relative humidity in 0.1 %
+ * @temperature:	temperature in 0.1 degree C
+ * @humidity_filtered:		@humidity after the driver's filter stage, the
+ *							same as @humidity when the filters are off
+ * @temperature_filtered:	@temperature after the filter stage
+ * @dew_point:		dew point of the filtered values in 0.1 degree C
+ * @heat_index:		heat index of the filtered values in 0.1 degree C
+ * @abs_humidity:	absolute humidity of the filtered values in 0.01 g/m^3,
+ *					see dht11_metrics.h for the three
+ *
+ * All fields are little endian, the record is 48 bytes with no holes.
+ * Reserved bytes are zero.
+ */
+struct dht11_record {
+	__le64 timestamp_ns;
+	__le32 seq;
+	__u8 status;
+	__u8 retries;
+	__u8 sensor_type;
+	__u8 reserved0;
+	__u8 raw[5];
+	__u8 reserved1[3];
+	__le16 humidity;
+	__le16 temperature;
+	__le16 humidity_filtered;
+	__le16 temperature_filtered;
+	__le16 dew_point;
+	__le16 heat_index;
+	__le16 abs_humidity;
+	__u8 reserved2[10];
+};
+
+/*
+ * struct dht11_history - header of the mmap()ed sample ring
+ * @seq:			incremented before and after every update, odd while updating
+ * @generation:		number of records written since the driver was loaded
+ * @head:			index of the slot the next record goes to
+ * @size:			number of record slots in the ring
+ * @record_size:	sizeof(struct dht11_record)
+ * @data_offset:	offset of the first slot from the start of the mapping
+ *
+ * Fields are in native byte order. The newest record is at
+ * (head + size - 1) % size, at most min(generation, size) slots are in use.
+ */
+struct dht11_history {
+	__u32 seq;
+	__u32 generation;
+	__u32 head;
+	__u32 size;
+	__u32 record_size;
+	__u32 data_offset;
+	__u32 reserved[10];
+};
+
+#define DHT11_HISTORY_OFFSET 64
+
+/*
+ * struct dht11_batch - argument of DHT11_IOC_GET_SAMPLES
+ * @since_seq:		in: sequence number of the first record wanted, 0 for the
+ *					oldest one in the ring
+ * @max_records:	in: number of records that fit in @records, at most
+ *					DHT11_BATCH_MAX are copied per call
+ * @records:		in: user pointer to an array of struct dht11_record
+ * @count:			out: number of records copied, oldest first
+ * @next_seq:		out: @since_seq for the next call
+ * @flags:			out: DHT11_BATCH_*
+ *
+ * Fields are in native byte order, the records are as in the ring.
+ */
+struct dht11_batch {
+	__u32 since_seq;
+	__u32 max_records;
+	__u64 records;
+	__u32 count;
+	__u32 next_seq;
+	__u32 flags;
+	__u32 reserved[3];
+};
+
+#define DHT11_BATCH_MAX 256
+#define DHT11_BATCH_OVERRUN 0x1		// Records since @since_seq were overwritten, copied from the oldest
+#define DHT11_BATCH_MORE 0x2		// More records are waiting than were copied
+
+/*
+ * struct dht11_aggregate - filtered values of one window
+ * @window_s:		length of the window in seconds, set with the agg_windows
+ *					module parameter
+ * @count:			number of good samples in the window
+ * @humidity_min, @humidity_max, @humidity_mean:	in 0.1 %
+ * @temperature_min, @temperature_max, @temperature_mean:	in 0.1 degree C
+ *
+ * The driver keeps each window as DHT11_AGG_BUCKETS time buckets, so it
+ * covers the last @window_s seconds with the oldest bucket dropping out
+ * whole. The values are zero when @count is.
+ */
+struct dht11_aggregate {
+	__u32 window_s;
+	__u32 count;
+	__s16 humidity_min;
+	__s16 humidity_max;
+	__s16 humidity_mean;
+	__s16 temperature_min;
+	__s16 temperature_max;
+	__s16 temperature_mean;
+	__u32 reserved;
+};
+
+#define DHT11_MAX_WINDOWS 4
+#define DHT11_AGG_BUCKETS 12
+
+/*
+ * struct dht11_aggregates - argument of DHT11_IOC_GET_AGGREGATES
+ * @timestamp_ns:	CLOCK_MONOTONIC time the windows end at
+ * @nwindows:		number of windows filled in
+ * @windows:		the windows in agg_windows order
+ *
+ * Fields are in native byte order.
+ */
+struct dht11_aggregates {
+	__u64 timestamp_ns;
+	__u32 nwindows;
+	__u32 reserved;
+	struct dht11_aggregate windows[DHT11_MAX_WINDOWS];
+};
+
+// Threshold value that turns a limit off
+#define DHT11_THRESHOLD_OFF (-32768)
+
+/*
+ * struct dht11_thresholds - argument of DHT11_IOC_{SET,GET}_THRESHOLDS
+ * @temperature_low, @temperature_high:	limits in 0.1 degree C
+ * @temperature_hyst:	how far back inside a limit the temperature has
+ *						to be to clear its alarm, in 0.1 degree C
+ * @humidity_low, @humidity_high, @humidity_hyst:	the same in 0.1 %
+ *
+ * The limits are checked against the filtered values of every good
+ * sample. A high alarm is raised when the value is above the limit and
+ * cleared when it is at or below limit - hyst, a low alarm the other way
+ * round. All limits start as DHT11_THRESHOLD_OFF, the hysteresis as 10.
+ */
+struct dht11_thresholds {
+	__s16 temperature_low;
+	__s16 temperature_high;
+	__s16 temperature_hyst;
+	__s16 humidity_low;
+	__s16 humidity_high;
+	__s16 humidity_hyst;
+	__u32 reserved;
+};
+
+// Alarm bits
+#define DHT11_ALARM_HUMIDITY_LOW 0x1
+#define DHT11_ALARM_HUMIDITY_HIGH 0x2
+#define DHT11_ALARM_TEMP_LOW 0x4
+#define DHT11_ALARM_TEMP_HIGH 0x8
+
+/*
+ * struct dht11_alarms - argument of DHT11_IOC_GET_ALARMS
+ * @alarms:			DHT11_ALARM_* raised now
+ * @changes:		number of times the alarms changed since the driver
+ *					was loaded, wraps around
+ * @timestamp_ns:	CLOCK_MONOTONIC time of the sample that last changed
+ *					them, 0 if they never did
+ */
+struct dht11_alarms {
+	__u32 alarms;
+	__u32 changes;
+	__u64 timestamp_ns;
+};
+
+/*
+ * struct dht11_read - argument of DHT11_IOC_READ
+ * @max_age_ms:	oldest sample the caller accepts, values below the sensor's
+ *				minimum interval (1 s for the DHT11, 2 s for the DHT22)
+ *				are raised to it
+ * @record:		the sample, filled in by the driver
+ *
+ * A cached sample that is young enough comes back at once, otherwise the
+ * call waits for a new one. Callers that ask at the same time share one
+ * transaction. Fails with EIO when that transaction gives up.
+ */
+struct dht11_read {
+	__u32 max_age_ms;
+	__u32 reserved;
+	struct dht11_record record;
+};
+
+/*
+ * Generic netlink family DHT11_GENL_NAME. Every good sample is multicast
+ * to the DHT11_GENL_MCGRP group as a DHT11_CMD_SAMPLE message, so any
+ * number of local listeners get it without opening the device files.
+ * DHT11_CMD_GET with DHT11_A_SENSOR asks for the latest good sample of
+ * one sensor, the reply is a DHT11_CMD_SAMPLE message too.
+ */
+#define DHT11_GENL_NAME "dht11"
+#define DHT11_GENL_VERSION 1
+#define DHT11_GENL_MCGRP "samples"
+
+enum {
+	DHT11_CMD_UNSPEC,
+	DHT11_CMD_SAMPLE,
+	DHT11_CMD_GET,
+	__DHT11_CMD_MAX,
+};
+#define DHT11_CMD_MAX (__DHT11_CMD_MAX - 1)
+
+enum {
+	DHT11_A_UNSPEC,
+	DHT11_A_SENSOR,		// u32, minor number of the sensor's device file
+	DHT11_A_RECORD,		// struct dht11_record
+	__DHT11_A_MAX,
+};
+#define DHT11_A_MAX (__DHT11_A_MAX - 1)
+
+#define DHT11_IOC_MAGIC 'd'
+
+// Select DHT11_FORMAT_TEXT or DHT11_FORMAT_BINARY for reads on this file
+#define DHT11_IOC_SET_FORMAT _IOW(DHT11_IOC_MAGIC, 1, int)
+// Copy the good samples kept in the history ring, see struct dht11_batch
+#define DHT11_IOC_GET_SAMPLES _IOWR(DHT11_IOC_MAGIC, 2, struct dht11_batch)
+// Min, max and mean of every aggregate window at once
+#define DHT11_IOC_GET_AGGREGATES _IOR(DHT11_IOC_MAGIC, 3, struct dht11_aggregates)
+#define DHT11_IOC_SET_THRESHOLDS _IOW(DHT11_IOC_MAGIC, 4, struct dht11_thresholds)
+#define DHT11_IOC_GET_THRESHOLDS _IOR(DHT11_IOC_MAGIC, 5, struct dht11_thresholds)
+// Current alarms, also clears POLLPRI on this file until they change again
+#define DHT11_IOC_GET_ALARMS _IOR(DHT11_IOC_MAGIC, 6, struct dht11_alarms)
+#define DHT11_IOC_READ _IOWR(DHT11_IOC_MAGIC, 7, struct dht11_read)
+
+#endif
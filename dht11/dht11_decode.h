@@ -0,0 +1,283 @@
+/* dht11_decode.h
+ *
+ * Bit decoder of the dht11 driver. It only does arithmetic on the edges
+ * the IRQ handler recorded, so the same code is built into the module and
+ * into tools/dht11_replay, which runs recorded or synthetic transactions
+ * through it on any machine. Keep it free of kernel calls: plain C on
+ * integers, no 64 bit divisions.
+ *
+ * A reply is an 80us low and 80us high response, then 40 bits of ~50us
+ * low followed by ~26us high for a 0 or ~70us high for a 1, then the line
+ * is released.
+ */
+#ifndef _DHT11_DECODE_H
+#define _DHT11_DECODE_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/string.h>
+#else
+#include <stdint.h>
+#include <string.h>
+#endif
+
+// Reply framing: response low/high, 40 bits of low/high, release. 84 edges without glitches
+#define DHT11_MAX_EDGES 96
+#define DHT11_MAX_PULSES (DHT11_MAX_EDGES / 2)
+#define DHT11_FRAME_BITS 40
+
+// Bit decoding
+#define DHT11_GLITCH_US 15		// High pulses shorter than this are noise
+#define DHT11_MIN_SPLIT_US 15	// Closer cluster means than this are one cluster
+#define DHT11_ZERO_US 27		// Nominal high time of a 0 bit
+#define DHT11_ONE_US 70			// Nominal high time of a 1 bit
+#define DHT11_LONG_US 80		// Data bit high pulses longer than this are noise too
+#define DHT11_RESPONSE_MIN_US 60	// Shortest response low pulse, nominally 80us
+
+// One edge of the reply as seen by the top half
+struct dht11_edge {
+	uint64_t ns;		// ktime_get_ns() when the IRQ ran
+	int level;			// Pin level after the edge
+};
+
+/*
+ * Decoder calibration, running averages of the 0 and 1 high times in
+ * 1/16 us taken from frames that passed the checksum. Used on its own for
+ * frames whose pulse widths do not split into two clusters.
+ */
+struct dht11_cal {
+	int zero_x16;
+	int one_x16;
+};
+
+// What the decoder made of one reply
+struct dht11_frame {
+	unsigned char data[5];			// Decoded bytes, zero for a short frame
+	int nbits;						// Data bits after the response, 0 without a response
+	int glitches;					// High pulses under DHT11_GLITCH_US
+	int long_pulses;				// Data bits over DHT11_LONG_US
+	int threshold;					// Widths above this were taken as 1
+	int zero_us, one_us;			// Cluster means, 0 if the frame did not split
+	int high_us[DHT11_MAX_PULSES];	// Every high pulse, glitches included
+	int nhigh;
+	int low_us[DHT11_MAX_PULSES];	// Every low pulse, the response comes first
+	int nlow;
+};
+
+static inline void dht11_cal_init(struct dht11_cal *cal)
+{
+	cal->zero_x16 = DHT11_ZERO_US * 16;
+	cal->one_x16 = DHT11_ONE_US * 16;
+}
+
+static inline int dht11_cal_threshold(const struct dht11_cal *cal)
+{
+	return (cal->zero_x16 + cal->one_x16) / 32;
+}
+
+// Move the calibration towards the cluster means of a frame that passed the checksum
+static inline void dht11_calibrate(struct dht11_cal *cal, const struct dht11_frame *frame)
+{
+	if (!frame->zero_us)
+		return;
+
+	cal->zero_x16 += (frame->zero_us * 16 - cal->zero_x16) / 8;
+	cal->one_x16 += (frame->one_us * 16 - cal->one_x16) / 8;
+}
+
+/*
+ * Split pulse widths into a short (0) and a long (1) cluster by iterating
+ * two means: start at threshold t, move the threshold to the midpoint of
+ * the two cluster means until it settles. That follows both clusters when
+ * IRQ latency shifts or smears them, and starts out right for the usual
+ * frame when t is the calibrated threshold. Returns 0 if the widths form
+ * one cluster.
+ */
+static inline int dht11_split_widths(const int *w, int n, int t, int *threshold,
+									 int *zero_mean, int *one_mean)
+{
+	long sum0, sum1;
+	int n0, n1;
+	int i, iter, next;
+
+	for (iter = 0; iter < 8; iter++) {
+		sum0 = sum1 = 0;
+		n0 = n1 = 0;
+		for (i = 0; i < n; i++) {
+			if (w[i] > t) {
+				sum1 += w[i];
+				n1++;
+			} else {
+				sum0 += w[i];
+				n0++;
+			}
+		}
+		if (!n0 || !n1)
+			return 0;
+
+		*zero_mean = sum0 / n0;
+		*one_mean = sum1 / n1;
+		next = (*zero_mean + *one_mean) / 2;
+		if (next == t)
+			break;
+		t = next;
+	}
+	if (*one_mean - *zero_mean < DHT11_MIN_SPLIT_US)
+		return 0;
+
+	*threshold = t;
+	return 1;
+}
+
+/*
+ * Pulse tracking, fed the edges of a reply in order. Edges that do not
+ * change the level are skipped, the line is high until the sensor pulls it
+ * low, so every high pulse follows a low one. The first high pulse that is
+ * not a glitch is the response pulse, the data bits follow it.
+ */
+struct dht11_pulses {
+	uint64_t edge_ns;		// Last edge that changed the level
+	int level;				// Level after it
+	int nedges;				// Edges that changed the level
+	int nhigh;				// High pulses that were not glitches, the response included
+};
+
+static inline void dht11_pulses_init(struct dht11_pulses *p)
+{
+	memset(p, 0, sizeof(*p));
+	p->level = 1;
+}
+
+/*
+ * Feed the next edge. Returns the width in us of the pulse the edge ends,
+ * or -1 if it ends none: the first edge, or one that keeps the level.
+ */
+static inline int dht11_pulse_edge(struct dht11_pulses *p, uint64_t ns, int level)
+{
+	int width = -1;
+
+	if (level == p->level)
+		return -1;
+	// Edges are at most a capture window apart, 32 bits hold the difference
+	if (p->nedges)
+		width = (int) ((uint32_t) (ns - p->edge_ns) / 1000);
+
+	p->edge_ns = ns;
+	p->level = level;
+	p->nedges++;
+	if (level == 0 && width >= DHT11_GLITCH_US)
+		p->nhigh++;
+
+	return width;
+}
+
+/*
+ * End of the capture, cheap enough for the IRQ handler: no division and
+ * only the edge recorded before. A falling edge at least DHT11_GLITCH_US
+ * after a rising one ends the response or a data bit, the capture paths
+ * stop once DHT11_CAPTURE_FALLS of them are in. The release edge after the
+ * last bit carries nothing. A reply that lost an edge never gets there and
+ * runs into the capture timeout instead.
+ */
+#define DHT11_CAPTURE_FALLS (DHT11_FRAME_BITS + 1)
+
+static inline int dht11_capture_fall(const struct dht11_edge *prev, uint64_t ns, int level)
+{
+	return level == 0 && prev->level == 1 && ns - prev->ns >= DHT11_GLITCH_US * 1000;
+}
+
+/*
+ * Decode one reply. The high time before each falling edge gives the bit.
+ * The response pulse is the first high pulse after the ~80us response low
+ * and is dropped, exactly 40 data pulses have to follow it: a reply that
+ * lost or gained a pulse would decode shifted, and a shifted frame can
+ * still pass the checksum. The bits are classified against this frame's
+ * own width distribution, or the calibrated threshold if the frame does
+ * not split into two clusters. Returns 0, or -1 for a reply without a
+ * response or with another number of data bits.
+ */
+static inline int dht11_decode(const struct dht11_edge *edges, unsigned int nedges,
+							   const struct dht11_cal *cal, struct dht11_frame *frame)
+{
+	int widths[DHT11_MAX_PULSES];
+	struct dht11_pulses p;
+	uint64_t start_ns = 0, rise_ns = 0;
+	int zero_mean, one_mean;
+	int response = 0;
+	unsigned int i;
+	int n = 0;
+	int width;
+
+	memset(frame, 0, sizeof(*frame));
+	if (nedges > DHT11_MAX_EDGES)
+		nedges = DHT11_MAX_EDGES;
+
+	dht11_pulses_init(&p);
+	for (i = 0; i < nedges; i++) {
+		width = dht11_pulse_edge(&p, edges[i].ns, edges[i].level);
+		if (p.nedges == 1)
+			start_ns = edges[i].ns;		// The sensor pulled the line low
+		if (width < 0)
+			continue;
+
+		// A low pulse is only timing
+		if (edges[i].level == 1) {
+			frame->low_us[frame->nlow++] = width;
+			rise_ns = edges[i].ns;
+			continue;
+		}
+
+		// A high pulse is a rising edge followed by a falling one
+		frame->high_us[frame->nhigh++] = width;
+		if (width < DHT11_GLITCH_US) {
+			frame->glitches++;
+			continue;
+		}
+		if (!response) {
+			// Everything up to its rising edge was the response low, glitches included
+			if ((uint32_t) (rise_ns - start_ns) / 1000 < DHT11_RESPONSE_MIN_US)
+				return -1;
+			response = 1;
+			continue;
+		}
+		if (n < DHT11_MAX_PULSES)
+			widths[n] = width;
+		n++;
+	}
+
+	frame->nbits = n;
+	if (n != DHT11_FRAME_BITS)
+		return -1;				// Leave data zero so the checksum fails
+
+	for (i = 0; i < DHT11_FRAME_BITS; i++) {
+		if (widths[i] > DHT11_LONG_US)
+			frame->long_pulses++;
+	}
+
+	if (dht11_split_widths(widths, DHT11_FRAME_BITS, dht11_cal_threshold(cal),
+						   &frame->threshold, &zero_mean, &one_mean)) {
+		frame->zero_us = zero_mean;
+		frame->one_us = one_mean;
+	} else {
+		frame->threshold = dht11_cal_threshold(cal);
+	}
+
+	for (i = 0; i < DHT11_FRAME_BITS; i++) {
+		if (widths[i] > frame->threshold)
+			frame->data[i / 8] |= 0x80 >> (i % 8);		// Add a 1 to the data byte
+	}
+
+	return 0;
+}
+
+/*
+ * The last byte is the sum of the others mod 256, so it can be 0 for a
+ * real reading. Only an all zero frame is no frame.
+ */
+static inline int dht11_checksum_ok(const unsigned char *data)
+{
+	return ((data[0] + data[1] + data[2] + data[3]) & 0xff) == data[4] &&
+		(data[0] | data[1] | data[2] | data[3]);
+}
+
+#endif
@@ -0,0 +1,187 @@
+/* dht11_metrics.h
+ *
+ * Metrics derived from a temperature and humidity reading: dew point, heat
+ * index and absolute humidity. The driver publishes them with every sample,
+ * tools/dht11_metrics_check compares them with the floating point formulas.
+ * Integer arithmetic only, the exponential is a table of the saturation
+ * vapour pressure. Inputs and outputs are in 0.1 units like the samples.
+ *
+ * Saturation vapour pressure (Magnus, as in the absolute humidity formula):
+ *		es(T) = 611.2 Pa * exp(17.67 * T / (T + 243.5))
+ * Dew point: the temperature at which es() equals the vapour pressure
+ * es(T) * RH, found by inverting the table.
+ * Absolute humidity: es(T) * RH * 2.1674 / (273.15 + T) g/m^3, es in hPa.
+ * Heat index: the NOAA procedure, Steadman's simple formula and Rothfusz'
+ * regression from DHT.cpp's computeHeatIndex() where that one gives 80 F or
+ * more, without NOAA's small corrections for very dry and very humid air.
+ */
+#ifndef _DHT11_METRICS_H
+#define _DHT11_METRICS_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/math64.h>
+#define dht11_div_s64(a, b) div_s64(a, b)
+#define dht11_div64_s64(a, b) div64_s64(a, b)
+#else
+#include <stdint.h>
+#define dht11_div_s64(a, b) ((int64_t) (a) / (int32_t) (b))
+#define dht11_div64_s64(a, b) ((int64_t) (a) / (int64_t) (b))
+#endif
+
+// Range of the vapour pressure table, readings outside are clamped to it
+#define DHT11_METRICS_MIN_C -40
+#define DHT11_METRICS_MAX_C 80
+
+/*
+ * es(T) in 0.01 Pa for every whole degree from DHT11_METRICS_MIN_C to
+ * DHT11_METRICS_MAX_C, interpolated linearly in between. The curve is
+ * close enough to straight over a degree to be within 0.05 %.
+ */
+static const uint32_t dht11_es_x100[DHT11_METRICS_MAX_C - DHT11_METRICS_MIN_C + 1] = {
+	1896, 2102, 2329, 2577, 2850, 3148, 3473, 3829,
+	4218, 4642, 5104, 5606, 6153, 6748, 7393, 8094,
+	8853, 9677, 10568, 11532, 12574, 13700, 14915, 16226,
+	17639, 19161, 20800, 22562, 24457, 26492, 28677, 31021,
+	33535, 36228, 39112, 42199, 45501, 49030, 52800, 56825,
+	61120, 65701, 70583, 75784, 81322, 87215, 93482, 100144,
+	107223, 114739, 122717, 131180, 140154, 149664, 159739, 170405,
+	181693, 193634, 206258, 219601, 233695, 248576, 264283, 280853,
+	298325, 316743, 336148, 356585, 378100, 400741, 424558, 449600,
+	475922, 503577, 532622, 563116, 595118, 628692, 663900, 700810,
+	739490, 780010, 822443, 866863, 913348, 961978, 1012834, 1066000,
+	1121563, 1179613, 1240241, 1303540, 1369609, 1438547, 1510456, 1585441,
+	1663611, 1745075, 1829949, 1918347, 2010391, 2106203, 2205909, 2309637,
+	2417520, 2529694, 2646297, 2767472, 2893363, 3024119, 3159894, 3300842,
+	3447124, 3598902, 3756344, 3919619, 4088902, 4264370, 4446206, 4634596,
+	4829728,
+};
+
+#define DHT11_METRICS_STEPS (DHT11_METRICS_MAX_C - DHT11_METRICS_MIN_C)
+
+// a / b rounded to the nearest integer, b > 0
+static inline int64_t dht11_div_round(int64_t a, int32_t b)
+{
+	return dht11_div_s64(a >= 0 ? a + b / 2 : a - b / 2, b);
+}
+
+// Same with a 64 bit divisor
+static inline int64_t dht11_div64_round(int64_t a, int64_t b)
+{
+	return dht11_div64_s64(a >= 0 ? a + b / 2 : a - b / 2, b);
+}
+
+// Saturation vapour pressure in 0.01 Pa at temperature t10 in 0.1 C
+static inline uint32_t dht11_es_x100_at(int t10)
+{
+	int i, frac;
+
+	if (t10 <= DHT11_METRICS_MIN_C * 10)
+		return dht11_es_x100[0];
+	if (t10 >= DHT11_METRICS_MAX_C * 10)
+		return dht11_es_x100[DHT11_METRICS_STEPS];
+
+	i = (t10 - DHT11_METRICS_MIN_C * 10) / 10;
+	frac = (t10 - DHT11_METRICS_MIN_C * 10) % 10;
+	return dht11_es_x100[i] + (dht11_es_x100[i + 1] - dht11_es_x100[i]) * frac / 10;
+}
+
+// Vapour pressure of the air in 0.01 Pa, rh10 in 0.1 %
+static inline uint32_t dht11_vapour_x100(int t10, int rh10)
+{
+	if (rh10 < 0)
+		rh10 = 0;
+	if (rh10 > 1000)
+		rh10 = 1000;
+
+	// es / 10 keeps the product in 32 bits, 0.1 Pa is plenty
+	return dht11_es_x100_at(t10) / 10 * rh10 / 100;
+}
+
+/*
+ * Dew point in 0.1 C. The table is searched for the vapour pressure and
+ * interpolated, dew points below DHT11_METRICS_MIN_C are returned as that.
+ */
+static inline int dht11_dew_point(int t10, int rh10)
+{
+	uint32_t e = dht11_vapour_x100(t10, rh10);
+	int lo = 0, hi = DHT11_METRICS_STEPS, mid;
+
+	if (e <= dht11_es_x100[0])
+		return DHT11_METRICS_MIN_C * 10;
+	if (e >= dht11_es_x100[DHT11_METRICS_STEPS])
+		return DHT11_METRICS_MAX_C * 10;
+
+	// Largest lo with es[lo] <= e
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (dht11_es_x100[mid] <= e)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return (DHT11_METRICS_MIN_C + lo) * 10 +
+		(int) ((e - dht11_es_x100[lo]) * 10 + (dht11_es_x100[lo + 1] - dht11_es_x100[lo]) / 2) /
+		(int) (dht11_es_x100[lo + 1] - dht11_es_x100[lo]);
+}
+
+// Absolute humidity in 0.01 g/m^3
+static inline int dht11_abs_humidity(int t10, int rh10)
+{
+	int64_t e = dht11_vapour_x100(t10, rh10);
+
+	if (t10 < DHT11_METRICS_MIN_C * 10)
+		t10 = DHT11_METRICS_MIN_C * 10;
+	if (t10 > DHT11_METRICS_MAX_C * 10)
+		t10 = DHT11_METRICS_MAX_C * 10;
+
+	return (int) dht11_div_round(e * 21674, 100 * (27315 + 10 * t10));
+}
+
+/*
+ * Heat index in 0.1 C. The inputs are clamped to the table range like in
+ * the other metrics, which keeps the sum below inside 64 bits. The
+ * temperature is converted to 0.01 F, which is exact. Rothfusz' regression
+ * works in F and %, with T = f / 100 and RH = h / 10 every term
+ * c * T^a * RH^b is scaled to c * 1e8 * f^a * h^b * 100^(2 - a) *
+ * 10^(2 - b), so all terms share the denominator 1e14.
+ */
+static inline int dht11_heat_index(int t10, int rh10)
+{
+	int f, h;
+	int simple;
+	int64_t sum;
+
+	if (t10 < DHT11_METRICS_MIN_C * 10)
+		t10 = DHT11_METRICS_MIN_C * 10;
+	if (t10 > DHT11_METRICS_MAX_C * 10)
+		t10 = DHT11_METRICS_MAX_C * 10;
+	if (rh10 < 0)
+		rh10 = 0;
+	if (rh10 > 1000)
+		rh10 = 1000;
+
+	f = t10 * 18 + 3200;			// 0.01 F
+	h = rh10;
+
+	// Steadman: 0.5 * (T + 61 + (T - 68) * 1.2 + RH * 0.094)
+	simple = (f * 10 + 61000 + (f - 6800) * 12 + h * 94 / 10) / 20;
+	if (simple + f < 16000)
+		return (int) dht11_div_round((int64_t) (simple - 3200) * 5, 90);
+
+	sum = -4237900000LL * 1000000 +
+		204901523LL * f * 10000 +
+		1014333127LL * h * 100000 -
+		22475541LL * f * h * 1000 -
+		683783LL * f * f * 100 -
+		5481717LL * h * h * 10000 +
+		122874LL * f * f * h * 10 +
+		85282LL * f * h * h * 100 -
+		199LL * f * f * h * h;
+
+	// 1e14 per F, (F - 32) * 5 / 9 * 10 for 0.1 C
+	return (int) dht11_div64_round((sum - 3200000000000000LL) * 5, 90000000000000LL);
+}
+
+#endif
@@ -0,0 +1,177 @@
+/* dht11_metrics_check.c
+ *
+ * Checks the fixed point metrics of dht11_metrics.h, as published by the
+ * driver, against the floating point formulas they replace, and times both.
+ *
+ * Usage:
+ * 		dht11_metrics_check [-n repeat]
+ * 			Sweep every temperature from -40.0C to 80.0C and every humidity
+ * 			from 0.0% to 100.0% in 0.1 steps, print the largest and the mean
+ * 			error of each metric and where the largest one is, then run
+ * 			both versions repeat times over a sample of the grid.
+ *
+ * The reference heat index is the same procedure in double, with
+ * DHT.cpp's computeHeatIndex() as the regression.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include "dht11_metrics.h"
+
+// Reference versions, inputs and outputs in whole units
+static double ref_es(double t)
+{
+	return 611.2 * exp(17.67 * t / (t + 243.5));
+}
+
+static double ref_dew_point(double t, double rh)
+{
+	double gamma;
+
+	if (rh <= 0)
+		return DHT11_METRICS_MIN_C;
+	gamma = log(rh / 100) + 17.67 * t / (t + 243.5);
+	return 243.5 * gamma / (17.67 - gamma);
+}
+
+static double ref_abs_humidity(double t, double rh)
+{
+	return ref_es(t) / 100 * rh * 2.1674 / (273.15 + t);
+}
+
+static double ref_heat_index(double t, double rh)
+{
+	double f = t * 1.8 + 32;
+	double hi;
+
+	hi = 0.5 * (f + 61 + (f - 68) * 1.2 + rh * 0.094);
+	if ((hi + f) / 2 >= 80)
+		hi = -42.379 +
+			2.04901523 * f +
+			10.14333127 * rh +
+			-0.22475541 * f * rh +
+			-0.00683783 * pow(f, 2) +
+			-0.05481717 * pow(rh, 2) +
+			0.00122874 * pow(f, 2) * rh +
+			0.00085282 * f * pow(rh, 2) +
+			-0.00000199 * pow(f, 2) * pow(rh, 2);
+
+	return (hi - 32) / 1.8;
+}
+
+// Error statistics of one metric
+struct error {
+	const char *name;
+	const char *unit;
+	double max;
+	double sum;
+	long n;
+	int max_t10, max_rh10;
+	double got, want;
+};
+
+static void add_error(struct error *e, double got, double want, int t10, int rh10)
+{
+	double err = fabs(got - want);
+
+	e->sum += err;
+	e->n++;
+	if (err > e->max) {
+		e->max = err;
+		e->max_t10 = t10;
+		e->max_rh10 = rh10;
+		e->got = got;
+		e->want = want;
+	}
+}
+
+static void print_error(const struct error *e)
+{
+	printf("%-18s max %.3f%s mean %.4f%s (at %.1fC %.1f%%: %.2f, want %.3f)\n", e->name,
+		   e->max, e->unit, e->sum / e->n, e->unit, e->max_t10 / 10.0, e->max_rh10 / 10.0,
+		   e->got, e->want);
+}
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	struct error dew = { "dew point", "C" };
+	struct error abs_h = { "absolute humidity", "g/m3" };
+	struct error heat = { "heat index", "C" };
+	volatile double dsink = 0;
+	volatile int isink = 0;
+	int repeat = 100;
+	double start, fixed_s, float_s;
+	long calls = 0;
+	int t10, rh10, r;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+			case 'n':
+				repeat = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, "usage: dht11_metrics_check [-n repeat]\n");
+				return 2;
+		}
+	}
+
+	for (t10 = DHT11_METRICS_MIN_C * 10; t10 <= DHT11_METRICS_MAX_C * 10; t10++) {
+		for (rh10 = 0; rh10 <= 1000; rh10++) {
+			// Below the table the driver clamps, that is not an error of the arithmetic
+			if (ref_dew_point(t10 / 10.0, rh10 / 10.0) > DHT11_METRICS_MIN_C)
+				add_error(&dew, dht11_dew_point(t10, rh10) / 10.0,
+						  ref_dew_point(t10 / 10.0, rh10 / 10.0), t10, rh10);
+			add_error(&abs_h, dht11_abs_humidity(t10, rh10) / 100.0,
+					  ref_abs_humidity(t10 / 10.0, rh10 / 10.0), t10, rh10);
+			add_error(&heat, dht11_heat_index(t10, rh10) / 10.0,
+					  ref_heat_index(t10 / 10.0, rh10 / 10.0), t10, rh10);
+		}
+	}
+
+	print_error(&dew);
+	print_error(&abs_h);
+	print_error(&heat);
+
+	if (repeat <= 0)
+		return 0;
+
+	// Every 7th temperature and humidity, all three metrics per point
+	start = now_s();
+	for (r = 0; r < repeat; r++) {
+		for (t10 = DHT11_METRICS_MIN_C * 10; t10 <= DHT11_METRICS_MAX_C * 10; t10 += 7) {
+			for (rh10 = 0; rh10 <= 1000; rh10 += 7) {
+				isink += dht11_dew_point(t10, rh10) + dht11_abs_humidity(t10, rh10) +
+					dht11_heat_index(t10, rh10);
+				calls++;
+			}
+		}
+	}
+	fixed_s = now_s() - start;
+
+	start = now_s();
+	for (r = 0; r < repeat; r++) {
+		for (t10 = DHT11_METRICS_MIN_C * 10; t10 <= DHT11_METRICS_MAX_C * 10; t10 += 7) {
+			for (rh10 = 0; rh10 <= 1000; rh10 += 7)
+				dsink += ref_dew_point(t10 / 10.0, rh10 / 10.0) +
+					ref_abs_humidity(t10 / 10.0, rh10 / 10.0) + ref_heat_index(t10 / 10.0, rh10 / 10.0);
+		}
+	}
+	float_s = now_s() - start;
+
+	printf("fixed point: %.1f ns per sample, floating point: %.1f ns per sample\n",
+		   fixed_s * 1e9 / calls, float_s * 1e9 / calls);
+
+	return 0;
+}
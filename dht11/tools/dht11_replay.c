@@ -0,0 +1,348 @@
+/* dht11_replay.c
+ *
+ * Runs DHT11 edge traces through the driver's own decoder (dht11_decode.h)
+ * without a sensor, to check decoder changes against real captures and to
+ * see how fast it is.
+ *
+ * Usage:
+ * 		dht11_replay [-n repeat] file...
+ * 			Decode the transactions in the files, "-" is stdin. The files are
+ * 			in the format of /sys/kernel/debug/dht11/<device>/edges, so a
+ * 			corpus can be collected on the Pi with i.e.
+ * 				while sleep 30; do cat /sys/kernel/debug/dht11/dht11/edges; done > corpus
+ * 			(the ring holds the last 16 transactions, duplicates are skipped
+ * 			by transaction number)
+ * 		dht11_replay -s count [-j jitter_us] [-b bias_us] [-g glitch_pct] [-l lost_pct] [-r seed] [-w]
+ * 			Decode count synthetic transactions with random data. Every edge
+ * 			is seen bias_us plus up to jitter_us late, glitch_pct percent of
+ * 			the bits get a 5us spike in their low pulse, lost_pct percent of
+ * 			the transactions lose a falling edge and the rising edge after
+ * 			it, as when an IRQ runs later than the low pulse lasts. The
+ * 			edges are cut where the driver ends the capture. -w writes the
+ * 			transactions to stdout instead, to build a corpus.
+ *
+ * Transactions the driver marked good, and all synthetic ones, have a known
+ * answer, the decoder is correct on them when it gives the same 5 bytes.
+ * A known transaction that decodes to other bytes with a good checksum
+ * would be published as a wrong sample, the exit status is 1 if there is
+ * one. The decoder is then run repeat times over all transactions to
+ * measure the decoded bits per second.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "dht11_decode.h"
+
+#define MAX_LINE 256
+
+// One transaction to decode
+struct transaction {
+	struct dht11_edge edges[DHT11_MAX_EDGES];
+	unsigned int nedges;
+	unsigned char data[5];		// Known answer
+	int known;
+};
+
+static struct transaction *transactions;
+static unsigned int ntransactions, max_transactions;
+
+static struct transaction *add_transaction(void)
+{
+	struct transaction *t;
+
+	if (ntransactions == max_transactions) {
+		max_transactions = max_transactions ? max_transactions * 2 : 256;
+		transactions = realloc(transactions, max_transactions * sizeof(*transactions));
+		if (!transactions) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	t = &transactions[ntransactions++];
+	memset(t, 0, sizeof(*t));
+
+	return t;
+}
+
+/*
+ * Read the transactions of an edges file. Transaction numbers seen before
+ * in the same file are skipped, so repeated dumps of the ring can simply be
+ * appended to each other.
+ */
+static void read_file(const char *name)
+{
+	char line[MAX_LINE], result[8];
+	struct transaction *t = NULL;
+	unsigned int id, last_id = 0, d[5];
+	unsigned long long ns;
+	int have_id = 0;
+	int skip = 0;
+	FILE *f;
+	int level;
+	int i;
+
+	f = strcmp(name, "-") ? fopen(name, "r") : stdin;
+	if (!f) {
+		perror(name);
+		exit(1);
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#') {
+			t = NULL;
+			skip = 0;
+			if (sscanf(line, "# transaction %u", &id) == 1) {
+				skip = have_id && id <= last_id;
+				last_id = id;
+				have_id = 1;
+			}
+			if (skip)
+				continue;
+
+			t = add_transaction();
+			if (strstr(line, " data ") &&
+				sscanf(strstr(line, " data "), " data %x %x %x %x %x %7s",
+					   &d[0], &d[1], &d[2], &d[3], &d[4], result) == 6 &&
+				!strcmp(result, "good")) {
+				for (i = 0; i < 5; i++)
+					t->data[i] = d[i];
+				t->known = 1;
+			}
+			continue;
+		}
+		if (!t || sscanf(line, "%llu %d", &ns, &level) != 2)
+			continue;
+		if (t->nedges < DHT11_MAX_EDGES) {
+			t->edges[t->nedges].ns = ns;
+			t->edges[t->nedges].level = level;
+			t->nedges++;
+		}
+	}
+
+	if (f != stdin)
+		fclose(f);
+}
+
+/*
+ * Add an edge that happens at ideal time us and is seen up to jitter_us
+ * later. The IRQ handler runs once per edge, so an edge is never seen
+ * before the one ahead of it. Like the driver, the edges stop at
+ * DHT11_MAX_EDGES or once dht11_capture_fall() counted the whole reply.
+ */
+static void add_edge(struct transaction *t, int *falls, double us, int level,
+					 int bias_us, int jitter_us)
+{
+	double late = bias_us + (jitter_us ? (double) rand() / RAND_MAX * jitter_us : 0);
+	uint64_t ns = (uint64_t) ((us + late) * 1000);
+
+	if (t->nedges && ns <= t->edges[t->nedges - 1].ns)
+		ns = t->edges[t->nedges - 1].ns + 1000;
+	if (t->nedges < DHT11_MAX_EDGES && *falls < DHT11_CAPTURE_FALLS) {
+		if (t->nedges && dht11_capture_fall(&t->edges[t->nedges - 1], ns, level))
+			(*falls)++;
+		t->edges[t->nedges].ns = ns;
+		t->edges[t->nedges].level = level;
+		t->nedges++;
+	}
+}
+
+/*
+ * A reply as the sensor sends it: 80us low, 80us high, then per bit 50us
+ * low and 26us or 70us high, then 50us low before the line is released.
+ */
+static void make_transaction(int bias_us, int jitter_us, int glitch_pct, int lost_pct)
+{
+	struct transaction *t = add_transaction();
+	int falls = 0;
+	double us = 30;
+	int lost = -1;				// Falling edge that is lost with the rising edge after it, -1 for the response
+	int i, bit;
+
+	for (i = 0; i < 4; i++)
+		t->data[i] = rand() & 0xff;
+	if (!(t->data[0] | t->data[1] | t->data[2] | t->data[3]))
+		t->data[0]++;			// An all zero frame is no frame, wrapped checksums are kept
+	t->data[4] = t->data[0] + t->data[1] + t->data[2] + t->data[3];
+	t->known = 1;
+	if (rand() % 100 < lost_pct)
+		lost = rand() % (DHT11_FRAME_BITS + 1) - 1;
+	else
+		lost = DHT11_FRAME_BITS;
+
+	/*
+	 * A lost pair is the falling edge that ends a high pulse and the rising
+	 * edge of the next one. The IRQ runs once for both and reads the line
+	 * high, the decoder skips that edge as it keeps the level.
+	 */
+	add_edge(t, &falls, us, 0, bias_us, jitter_us);
+	us += 80;
+	add_edge(t, &falls, us, 1, bias_us, jitter_us);
+	us += 80;
+	if (lost != -1)
+		add_edge(t, &falls, us, 0, bias_us, jitter_us);
+
+	for (i = 0; i < DHT11_FRAME_BITS; i++) {
+		bit = t->data[i / 8] & (0x80 >> (i % 8));
+		if (rand() % 100 < glitch_pct && lost != i - 1) {
+			add_edge(t, &falls, us + 20, 1, bias_us, jitter_us);
+			add_edge(t, &falls, us + 25, 0, bias_us, 0);
+		}
+		us += 50;
+		if (lost != i - 1)
+			add_edge(t, &falls, us, 1, bias_us, jitter_us);
+		us += bit ? DHT11_ONE_US : DHT11_ZERO_US;
+		if (lost != i)
+			add_edge(t, &falls, us, 0, bias_us, jitter_us);
+	}
+	us += 50;
+	if (lost != DHT11_FRAME_BITS - 1)
+		add_edge(t, &falls, us, 1, bias_us, jitter_us);
+}
+
+static void write_transactions(void)
+{
+	struct transaction *t;
+	unsigned int i, j;
+
+	for (i = 0; i < ntransactions; i++) {
+		t = &transactions[i];
+		printf("# transaction %u synthetic edges %u data %02x %02x %02x %02x %02x good\n", i,
+			   t->nedges, t->data[0], t->data[1], t->data[2], t->data[3], t->data[4]);
+		for (j = 0; j < t->nedges; j++)
+			printf("%llu %d\n", (unsigned long long) t->edges[j].ns, t->edges[j].level);
+		printf("\n");
+	}
+}
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: dht11_replay [-n repeat] file...\n"
+			"       dht11_replay -s count [-j jitter_us] [-b bias_us] [-g glitch_pct] [-l lost_pct] [-r seed] [-n repeat] [-w]\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	int synthetic = 0, jitter_us = 0, bias_us = 0, glitch_pct = 0, lost_pct = 0, repeat = 1000, write = 0;
+	unsigned int short_frames = 0, checksum_ok = 0, known = 0, correct = 0, wrong = 0;
+	unsigned int seed = 1;
+	struct dht11_frame frame;
+	struct dht11_cal cal;
+	struct transaction *t;
+	volatile unsigned char sink = 0;
+	double start, elapsed;
+	unsigned int i;
+	int opt, r;
+
+	while ((opt = getopt(argc, argv, "s:j:b:g:l:r:n:w")) != -1) {
+		switch (opt) {
+			case 's':
+				synthetic = atoi(optarg);
+				break;
+			case 'j':
+				jitter_us = atoi(optarg);
+				break;
+			case 'b':
+				bias_us = atoi(optarg);
+				break;
+			case 'g':
+				glitch_pct = atoi(optarg);
+				break;
+			case 'l':
+				lost_pct = atoi(optarg);
+				break;
+			case 'r':
+				seed = atoi(optarg);
+				break;
+			case 'n':
+				repeat = atoi(optarg);
+				break;
+			case 'w':
+				write = 1;
+				break;
+			default:
+				usage();
+		}
+	}
+
+	if (synthetic > 0) {
+		srand(seed);
+		for (r = 0; r < synthetic; r++)
+			make_transaction(bias_us, jitter_us, glitch_pct, lost_pct);
+	} else if (optind < argc) {
+		for (r = optind; r < argc; r++)
+			read_file(argv[r]);
+	} else {
+		usage();
+	}
+
+	if (write) {
+		write_transactions();
+		return 0;
+	}
+	if (!ntransactions) {
+		fprintf(stderr, "no transactions\n");
+		return 1;
+	}
+
+	// Decode in order with a running calibration, like the driver does
+	dht11_cal_init(&cal);
+	for (i = 0; i < ntransactions; i++) {
+		t = &transactions[i];
+		if (dht11_decode(t->edges, t->nedges, &cal, &frame) < 0)
+			short_frames++;
+		if (dht11_checksum_ok(frame.data)) {
+			checksum_ok++;
+			dht11_calibrate(&cal, &frame);
+		}
+		if (t->known) {
+			known++;
+			if (!memcmp(frame.data, t->data, sizeof(t->data)))
+				correct++;
+			else if (dht11_checksum_ok(frame.data))
+				wrong++;
+		}
+	}
+
+	printf("transactions: %u\n", ntransactions);
+	printf("short frames: %u\n", short_frames);
+	printf("checksum ok: %u (%.2f%%)\n", checksum_ok, 100.0 * checksum_ok / ntransactions);
+	if (known)
+		printf("correct: %u of %u known (%.2f%%), wrong with a good checksum: %u\n", correct, known,
+			   100.0 * correct / known, wrong);
+	printf("calibration: 0: %dus 1: %dus threshold: %dus\n", cal.zero_x16 / 16, cal.one_x16 / 16,
+		   dht11_cal_threshold(&cal));
+
+	// Speed, the same work per transaction as decode_tasklet_func()
+	if (repeat > 0) {
+		start = now_s();
+		for (r = 0; r < repeat; r++) {
+			dht11_cal_init(&cal);
+			for (i = 0; i < ntransactions; i++) {
+				t = &transactions[i];
+				dht11_decode(t->edges, t->nedges, &cal, &frame);
+				if (dht11_checksum_ok(frame.data))
+					dht11_calibrate(&cal, &frame);
+				sink ^= frame.data[0];
+			}
+		}
+		elapsed = now_s() - start;
+		printf("speed: %.0f transactions/s, %.0f bits/s (%.1f ns per transaction)\n",
+			   repeat * (double) ntransactions / elapsed,
+			   repeat * (double) ntransactions * DHT11_FRAME_BITS / elapsed,
+			   elapsed * 1e9 / (repeat * (double) ntransactions));
+	}
+
+	return wrong ? 1 : 0;
+}
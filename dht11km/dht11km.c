@@ -51,6 +51,9 @@
 #include <linux/irq.h>
 #include <linux/fcntl.h>
 #include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/completion.h>
 
 #include <linux/fs.h>
 #include <asm/uaccess.h>	// for put_user 
@@ -63,6 +66,12 @@
 #define SUCCESS 0
 #define BUF_LEN 80		// Max length of the message from the device 
 
+// Acquisition timing
+#define DHT11_START_MS 20		// DHT11 needs min 18mS to signal a startup
+#define DHT11_CAPTURE_MS 10		// Give the dht11 time to reply
+#define DHT11_RETRY_MS 1100		// Can only read from sensor every 1 second so give it time to recover
+#define DHT11_MAX_RETRY 5
+
 // set GPIO pin g as input 
 #define GPIO_DIR_INPUT(g) *(gpio+((g)/10)) &= ~(7<<(((g)%10)*3))
 // set GPIO pin g as output 
@@ -104,6 +113,19 @@ static unsigned char dht[5];			// For result bytes
 static int format = 0;		//Default result format
 static int gpio_pin = 0;		//Default GPIO pin
 static int driverno = 80;		//Default driver number
+static unsigned long last_cpu_ns = 0;	//CPU time spent by the last read, in ns
+
+// Acquisition state machine, stepped by dht11_timer and irq_handler()
+enum dht11_state {
+	DHT11_IDLE,
+	DHT11_START,		//Start pulse, line held low
+	DHT11_CAPTURE		//Sensor replies, edges are timed by irq_handler()
+};
+
+static enum dht11_state state = DHT11_IDLE;
+static struct hrtimer dht11_timer;
+static struct completion dht11_done;	//Signalled when the capture window closes
+static u64 busy_ns;						//CPU time of the current transaction
 
 //Operations that can be performed on the device
 static struct file_operations fops = {
@@ -124,6 +146,7 @@ static irqreturn_t irq_handler(int i, void *blah, struct pt_regs *regs)
 	long deltv;
 	int data = 0;
 	int signal;
+	ktime_t enter = ktime_get();
 
 	// use the GPIO signal level 
 	signal = GPIO_READ_PIN(gpio_pin);
@@ -131,6 +154,10 @@ static irqreturn_t irq_handler(int i, void *blah, struct pt_regs *regs)
 	/* reset interrupt */
 	GPIO_INT_CLEAR(gpio_pin);
 
+	// All 5 bytes are in, ignore the line until the capture window closes
+	if (bytecount == 5)
+		goto out;
+
 	if (sense != -1) {
 		// get current time 
 		do_gettimeofday(&tv);
@@ -144,15 +171,15 @@ static irqreturn_t irq_handler(int i, void *blah, struct pt_regs *regs)
 		if((signal == 1)&(data > 40))
 			{
 			started = 1;
-			return IRQ_HANDLED;	
+			goto out;
 			}
 			
 		if((signal == 0)&(started==1))
 			{
 			if(data > 80)
-				return IRQ_HANDLED;										//Start/spurious? signal
+				goto out;										//Start/spurious? signal
 			if(data < 15)
-				return IRQ_HANDLED;										//Spurious signal?
+				goto out;										//Spurious signal?
 			if (data > 60)//55 
 				dht[bytecount] = dht[bytecount] | (0x80 >> bitcount);	//Add a 1 to the data byte
 			
@@ -168,13 +195,14 @@ static irqreturn_t irq_handler(int i, void *blah, struct pt_regs *regs)
 			//	printk(KERN_INFO DHT11_DRIVER_NAME "Result: %d, %d, %d, %d, %d\n", dht[0], dht[1], dht[2], dht[3], dht[4]);
 			}
 		}
+out:
+	busy_ns += ktime_to_ns(ktime_sub(ktime_get(), enter));
 	return IRQ_HANDLED;
 }
 
 static int setup_interrupts(void)
 {
 	int result;
-	unsigned long flags;
 
 	result = request_irq(INTERRUPT_GPIO0, (irq_handler_t) irq_handler, 0, DHT11_DRIVER_NAME, (void*) gpio);
 
@@ -190,6 +218,14 @@ static int setup_interrupts(void)
 		break;
 	};
 
+	return 0;
+}
+
+// Enable the GPIO edge detect interrupts, only while the sensor is replying
+static void enable_edge_detect(void)
+{
+	unsigned long flags;
+
 	spin_lock_irqsave(&lock, flags);
 
 	// GPREN0 GPIO Pin Rising Edge Detect Enable 
@@ -201,8 +237,55 @@ static int setup_interrupts(void)
 	GPIO_INT_CLEAR(gpio_pin);
 
 	spin_unlock_irqrestore(&lock, flags);
+}
 
-	return 0;
+// Disable the GPIO edge detect interrupts
+static void disable_edge_detect(void)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lock, flags);
+
+	// GPREN0 GPIO Pin Rising Edge Detect Disable 
+	GPIO_INT_RISING(gpio_pin, 0);
+
+	// GPFEN0 GPIO Pin Falling Edge Detect Disable 
+	GPIO_INT_FALLING(gpio_pin, 0);
+
+	spin_unlock_irqrestore(&lock, flags);
+}
+
+// Timer handler - steps the acquisition state machine while read_dht11() sleeps
+static enum hrtimer_restart dht11_timer_func(struct hrtimer *timer)
+{
+	enum hrtimer_restart ret = HRTIMER_RESTART;
+	ktime_t enter = ktime_get();
+
+	switch (state) {
+	case DHT11_START:
+		// Take pin high and hand the line to the sensor, the pull-up keeps it
+		// high until the DHT11 answers
+		GPIO_SET_PIN(gpio_pin);
+		GPIO_DIR_INPUT(gpio_pin);
+
+		//Start timer to time pulse length
+		do_gettimeofday(&lasttv);
+		enable_edge_detect();
+		state = DHT11_CAPTURE;
+		hrtimer_forward_now(timer, ms_to_ktime(DHT11_CAPTURE_MS));
+		break;
+	case DHT11_CAPTURE:
+		disable_edge_detect();
+		/* fall through */
+	default:
+		state = DHT11_IDLE;
+		complete(&dht11_done);
+		ret = HRTIMER_NORESTART;
+		break;
+	}
+
+	busy_ns += ktime_to_ns(ktime_sub(ktime_get(), enter));
+	return ret;
 }
 
 // Initialise GPIO memory
@@ -240,7 +323,12 @@ static int __init dht11_init_module(void)
 		printk(KERN_ERR DHT11_DRIVER_NAME ": invalid GPIO pin specified!\n");
 		goto exit_rpi;
 	}
-	
+
+	spin_lock_init(&lock);
+	init_completion(&dht11_done);
+	hrtimer_init(&dht11_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	dht11_timer.function = dht11_timer_func;
+
     result = register_chrdev(driverno, DHT11_DRIVER_NAME, &fops);
 
 	if (result < 0) {
@@ -263,6 +351,8 @@ exit_rpi:
 
 static void __exit dht11_exit_module(void)
 {
+	hrtimer_cancel(&dht11_timer);
+
 	// release mapped memory and allocated region 
 	if(gpio != NULL) {
 		iounmap(gpio);
@@ -278,8 +368,9 @@ static void __exit dht11_exit_module(void)
 // Called when a process wants to read the dht11 "cat /dev/dht11"
 static int read_dht11(struct inode *inode, struct file *file)
 {
-	char result[3];			//To say if the result is trustworthy or not
+	char result[4];			//To say if the result is trustworthy or not
 	int retry = 0;
+	int err;
 	
 	if (Device_Open)
 		return -EBUSY;
@@ -288,6 +379,14 @@ static int read_dht11(struct inode *inode, struct file *file)
 
 	Device_Open++;
 
+	err = setup_interrupts();
+	if (err < 0) {
+		module_put(THIS_MODULE);
+		Device_Open--;
+		return err;
+	}
+	busy_ns = 0;
+
 	// Take data low for min 18mS to start up DHT11
     //printk(KERN_INFO DHT11_DRIVER_NAME " Start setup (read_dht11)\n");
 
@@ -300,38 +399,45 @@ start_read:
 	dht[2] = 0;
 	dht[3] = 0;
 	dht[4] = 0;
+	reinit_completion(&dht11_done);
 	GPIO_DIR_OUTPUT(gpio_pin); 	// Set pin to output
     GPIO_CLEAR_PIN(gpio_pin);	// Set low
-    mdelay(20);					// DHT11 needs min 18mS to signal a startup
-    GPIO_SET_PIN(gpio_pin);		// Take pin high
-    udelay(40);					// Stay high for a bit before swapping to read mode
-    GPIO_DIR_INPUT(gpio_pin); 	// Change to read
-	
-	//Start timer to time pulse length
-	do_gettimeofday(&lasttv);
-	
-	// Set up interrupts
-	setup_interrupts();
-	
-	//Give the dht11 time to reply
-	mdelay(10);
+	state = DHT11_START;
+	hrtimer_start(&dht11_timer, ms_to_ktime(DHT11_START_MS), HRTIMER_MODE_REL);
+
+	//Sleep while the timer ends the start pulse and the IRQ captures the reply
+	if (wait_for_completion_interruptible(&dht11_done)) {
+		hrtimer_cancel(&dht11_timer);
+		if (state == DHT11_CAPTURE)
+			disable_edge_detect();
+		state = DHT11_IDLE;
+		GPIO_DIR_INPUT(gpio_pin);
+		close_dht11(inode, file);
+		return -ERESTARTSYS;
+	}
 	
-	//Check if the read results are valid. If not then try again!
+//Check if the read results are valid. If not then try again!
 	if((dht[0] + dht[1] + dht[2] + dht[3] == dht[4]) & (dht[4] > 0))
 		sprintf(result, "OK");
 	else
 		{
 		retry++;
 		sprintf(result, "BAD");
-		if(retry == 5)
+		if(retry == DHT11_MAX_RETRY)
 			goto return_result;		//We tried 5 times so bail out
-		clear_interrupts();
-		mdelay(1100);				//Can only read from sensor every 1 second so give it time to recover
+		if (msleep_interruptible(DHT11_RETRY_MS)) {
+			//Signal while waiting for the sensor to recover, give the IRQ and the device back
+			state = DHT11_IDLE;
+			close_dht11(inode, file);
+			return -ERESTARTSYS;
+		}
 		goto start_read;
 		}
 
 		//Return the result in various different formats
 return_result:	
+	last_cpu_ns = busy_ns;
+
 	switch(format){
 		case 0:
 			sprintf(msg, "Values: %d, %d, %d, %d, %d, %s\n", dht[0], dht[1], dht[2], dht[3], dht[4], result);
@@ -365,21 +471,9 @@ static int close_dht11(struct inode *inode, struct file *file)
 	return 0;
 }
 	
-// Clear the GPIO edge detect interrupts
+// Release the IRQ, edge detection was disabled when the capture window closed
 static void clear_interrupts(void)
 {
-	unsigned long flags;
-
-	spin_lock_irqsave(&lock, flags);
-
-	// GPREN0 GPIO Pin Rising Edge Detect Disable 
-	GPIO_INT_RISING(gpio_pin, 0);
-
-	// GPFEN0 GPIO Pin Falling Edge Detect Disable 
-	GPIO_INT_FALLING(gpio_pin, 0);
-
-	spin_unlock_irqrestore(&lock, flags);
-
 	free_irq(INTERRUPT_GPIO0, (void *) gpio);
 }
 
@@ -425,3 +519,5 @@ module_param(gpio_pin, int, S_IRUGO);
 MODULE_PARM_DESC(gpio_pin, "GPIO pin to use");
 module_param(driverno, int, S_IRUGO);
 MODULE_PARM_DESC(driverno, "Driver handler major value");
+module_param(last_cpu_ns, ulong, S_IRUGO);
+MODULE_PARM_DESC(last_cpu_ns, "CPU time spent in timer and IRQ context by the last read (ns)");
@@ -5,11 +5,15 @@
 #include <linux/errno.h>
 #include <linux/ioport.h>
 #include <linux/io.h>
+#include <linux/ktime.h>
 
 // include RPi harware specific constants
 // GPIO_BASE SZ_4K
 #include <mach/hardware.h>
 
+#define CREATE_TRACE_POINTS
+#include "led_trace.h"
+
 #define LED_DRIVER_NAME   "led"
 
 /* GPIO macros */
@@ -20,6 +24,7 @@
 struct timer_list led_timer;
 char kbledstatus = 0;
 int status = 0;
+static ktime_t last_toggle;    // For the time between toggles in the trace
 
 static int gpio_pin = 17;   //default GPIO pin
 
@@ -51,7 +56,8 @@ static int init_port(void)
 
 void hello_timer(unsigned long ptr)
 {
-	printk(KERN_ALERT "jiffies + HZ = %ld + %d\n", jiffies, HZ);
+    ktime_t now = ktime_get();
+
     if (status == 0)
     {
         GPIO_SET_PIN(gpio_pin);
@@ -60,6 +66,8 @@ void hello_timer(unsigned long ptr)
         GPIO_CLR_PIN(gpio_pin);
         status = 0;
     }
+    trace_led_toggle(gpio_pin, status, 1, ktime_us_delta(now, last_toggle));
+    last_toggle = now;
 
     led_timer.expires = jiffies + HZ;
     add_timer(&led_timer);
@@ -8,6 +8,7 @@
 #include <linux/errno.h>
 #include <linux/ioport.h>
 #include <linux/io.h>
+#include <linux/ktime.h>
 #include <asm/uaccess.h>
 #include <linux/proc_fs.h>
 
@@ -15,6 +16,9 @@
 // GPIO_BASE SZ_4K
 #include <mach/hardware.h>
 
+#define CREATE_TRACE_POINTS
+#include "led_trace.h"
+
 #define LED_DRIVER_NAME   "led"
 #define DEV_COUNT   1
 
@@ -26,6 +30,7 @@
 struct timer_list led_timer;
 char kbledstatus = 0;
 int status = 0;
+static ktime_t last_toggle;    // For the time between toggles in the trace
 
 static int gpio_pin = 17;   //default GPIO pin
 // Possible valid GPIO pins
@@ -67,7 +72,8 @@ static int init_port(void)
 
 void led_timer_fun(unsigned long ptr)
 {
-	printk(KERN_ALERT "jiffies + HZ = %ld + %d\n", jiffies, HZ);
+    ktime_t now = ktime_get();
+
     if (status == 0)
     {
         GPIO_SET_PIN(gpio_pin);
@@ -76,6 +82,8 @@ void led_timer_fun(unsigned long ptr)
         GPIO_CLR_PIN(gpio_pin);
         status = 0;
     }
+    trace_led_toggle(gpio_pin, status, led_devices->blink_freq, ktime_us_delta(now, last_toggle));
+    last_toggle = now;
 
     led_timer.expires = jiffies + HZ/led_devices->blink_freq;
     add_timer(&led_timer);
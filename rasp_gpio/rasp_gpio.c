@@ -13,6 +13,9 @@
 #include <linux/slab.h>
 #include <asm/uaccess.h>
 
+#define CREATE_TRACE_POINTS
+#include "rasp_gpio_trace.h"
+
 /* User-defined macros */
 #define NUM_GPIO_PINS       21
 #define MAX_GPIO_NUMBER     32
@@ -106,18 +109,18 @@ unsigned int millis(void)
  */
 static irqreturn_t irq_handler(int irq, void *arg)
 {
-  unsigned long flags;
+  struct raspi_gpio_dev *raspi_gpio_devp = arg;
   unsigned int interrupt_time = millis();
+  unsigned int delta = interrupt_time - last_interrupt_time;
 
-  if(interrupt_time - last_interrupt_time < 200){
-    printk(KERN_NOTICE "Ignored Interrupt [%d]\n", irq);
+  // The minor number of a pin's device is the pin number
+  if(delta < 200){
+    trace_raspi_gpio_irq(irq, MINOR(raspi_gpio_devp->cdev.dev), delta, true);
     return IRQ_HANDLED;
   }
   last_interrupt_time = interrupt_time;
 
-  local_irq_save(flags);
-  printk(KERN_NOTICE "Interrupt [%d] was triggered\n", irq);
-  local_irq_restore(flags);
+  trace_raspi_gpio_irq(irq, MINOR(raspi_gpio_devp->cdev.dev), delta, false);
 
   return IRQ_HANDLED;
 }
@@ -275,7 +278,7 @@ static ssize_t raspi_gpio_write(struct file *filp,
     return -EFAULT;
   kbuf[len] = '\0';
 
-  printk(KERN_INFO "Request from user: %s\n", kbuf);
+  trace_raspi_gpio_write(gpio, kbuf);
 
   // Check the content of kbuf and set GPIO pin accordingly
   if(strcmp(kbuf, "out") == 0){
@@ -0,0 +1,72 @@
+/* 
+ * rasp_gpio_trace.h - Tracepoints of the GPIO driver
+ *
+ * These replace the printk calls on every write and every interrupt.
+ * They cost next to nothing while disabled, to record:
+ *   echo 1 > /sys/kernel/debug/tracing/events/raspi_gpio/enable
+ *   cat /sys/kernel/debug/tracing/trace_pipe
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM raspi_gpio
+
+#if !defined(_RASPI_GPIO_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _RASPI_GPIO_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * raspi_gpio_irq - an interrupt on a GPIO pin
+ * @delta_ms:   time since the previous interrupt
+ * @ignored:    within the 200 ms debounce time
+ */
+TRACE_EVENT(raspi_gpio_irq,
+  TP_PROTO(int irq, unsigned int gpio, unsigned int delta_ms, bool ignored),
+  TP_ARGS(irq, gpio, delta_ms, ignored),
+
+  TP_STRUCT__entry(
+    __field(int, irq)
+    __field(unsigned int, gpio)
+    __field(unsigned int, delta_ms)
+    __field(bool, ignored)
+  ),
+
+  TP_fast_assign(
+    __entry->irq = irq;
+    __entry->gpio = gpio;
+    __entry->delta_ms = delta_ms;
+    __entry->ignored = ignored;
+  ),
+
+  TP_printk("irq=%d gpio=%u delta=%ums%s", __entry->irq, __entry->gpio,
+            __entry->delta_ms, __entry->ignored ? " ignored" : "")
+);
+
+/*
+ * raspi_gpio_write - a request written to a GPIO device node
+ * @request:    the command, "in", "out", "1", "0", "rising", ...
+ */
+TRACE_EVENT(raspi_gpio_write,
+  TP_PROTO(unsigned int gpio, const char *request),
+  TP_ARGS(gpio, request),
+
+  TP_STRUCT__entry(
+    __field(unsigned int, gpio)
+    __string(request, request)
+  ),
+
+  TP_fast_assign(
+    __entry->gpio = gpio;
+    __assign_str(request, request);
+  ),
+
+  TP_printk("gpio=%u request=%s", __entry->gpio, __get_str(request))
+);
+
+#endif
+
+/* The header is in the module's directory, not in include/trace/events */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE rasp_gpio_trace
+#include <trace/define_trace.h>